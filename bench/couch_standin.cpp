@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "couch_standin.h"
+
+CouchStandIn::CouchStandIn(const string& dbName)
+{
+	db = dbName;
+	listenFd = -1;
+	port = 0;
+	stopping = false;
+}
+
+CouchStandIn::~CouchStandIn()
+{
+	stop();
+}
+
+// the corpus escapes newlines in the text as \n
+static string unescape_newlines(const string& text)
+{
+	string result;
+	result.reserve(text.length());
+
+	for (size_t i = 0; i < text.length(); i++)
+	{
+		if (text[i] == '\\' && i + 1 < text.length() && text[i + 1] == 'n')
+		{
+			result += '\n';
+			i++;
+		}
+		else
+			result += text[i];
+	}
+
+	return result;
+}
+
+size_t CouchStandIn::load_tsv(const char* path, int repeat)
+{
+	ifstream file(path);
+	string line;
+	vector<string> columns;
+
+	while (getline(file, line))
+	{
+		columns.clear();
+
+		size_t start = 0;
+		size_t tab;
+		while ((tab = line.find('\t', start)) != string::npos)
+		{
+			columns.push_back(line.substr(start, tab - start));
+			start = tab + 1;
+		}
+		columns.push_back(line.substr(start));
+
+		if (columns.size() < 4)
+			continue;
+
+		// repeated copies get their own ids so the corpus can be scaled up
+		for (int r = 0; r < repeat; r++)
+		{
+			Json::Value doc;
+			ostringstream id;
+			id << columns[0];
+			if (r > 0)
+				id << "-" << r;
+
+			doc["_id"] = id.str();
+			doc["_rev"] = "1-bench";
+			doc["title"] = columns[1];
+			doc["date"] = columns[2];
+			doc["text"] = unescape_newlines(columns[3]);
+			add_doc(doc);
+		}
+	}
+
+	return docs.size();
+}
+
+void CouchStandIn::add_doc(const Json::Value& doc)
+{
+	byId[doc["_id"].asString()] = docs.size();
+	docs.push_back(doc);
+}
+
+void CouchStandIn::set_design(const Json::Value& designDoc)
+{
+	design = designDoc;
+}
+
+size_t CouchStandIn::doc_count() const
+{
+	return docs.size();
+}
+
+const Json::Value& CouchStandIn::doc(size_t i) const
+{
+	return docs[i];
+}
+
+bool CouchStandIn::start()
+{
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenFd < 0)
+		return false;
+
+	int on = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, (const char*) &on, sizeof(on));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	socklen_t length = sizeof(addr);
+	if (bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0 ||
+		getsockname(listenFd, (struct sockaddr*) &addr, &length) != 0)
+	{
+		close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+
+	port = ntohs(addr.sin_port);
+	stopping = false;
+	thread = _LUCENE_THREAD_CREATE(&serve, this);
+
+	return true;
+}
+
+void CouchStandIn::stop()
+{
+	if (listenFd < 0)
+		return;
+
+	// unblocks accept() in the serving thread
+	stopping = true;
+	shutdown(listenFd, SHUT_RDWR);
+	close(listenFd);
+	_LUCENE_THREAD_JOIN(thread);
+	listenFd = -1;
+}
+
+string CouchStandIn::url() const
+{
+	ostringstream u;
+	u << "http://127.0.0.1:" << port << "/";
+	return u.str();
+}
+
+_LUCENE_THREAD_FUNC(CouchStandIn::serve, arg)
+{
+	CouchStandIn* server = (CouchStandIn*) arg;
+
+	while (!server->stopping)
+	{
+		int fd = accept(server->listenFd, NULL, NULL);
+		if (fd < 0)
+			break;
+
+		server->serve_connection(fd);
+		close(fd);
+	}
+
+	_LUCENE_THREAD_FUNC_RETURN(0);
+}
+
+void CouchStandIn::serve_connection(int fd)
+{
+	// curl keeps the connection open between requests made with one handle
+	string input;
+	char buffer[16384];
+
+	while (true)
+	{
+		size_t headerEnd;
+		while ((headerEnd = input.find("\r\n\r\n")) == string::npos)
+		{
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0)
+				return;
+			input.append(buffer, (size_t) n);
+		}
+
+		string headers = input.substr(0, headerEnd);
+		size_t contentLength = 0;
+		size_t lengthPos = headers.find("Content-Length:");
+		if (lengthPos != string::npos)
+			contentLength = (size_t) atol(headers.c_str() + lengthPos + 15);
+
+		// curl waits for this before sending a large POST body
+		if (headers.find("Expect: 100-continue") != string::npos)
+			send(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, 0);
+
+		while (input.length() < headerEnd + 4 + contentLength)
+		{
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0)
+				return;
+			input.append(buffer, (size_t) n);
+		}
+
+		// request line: METHOD target HTTP/1.1
+		size_t methodEnd = headers.find(' ');
+		size_t targetEnd = headers.find(' ', methodEnd + 1);
+		string method = headers.substr(0, methodEnd);
+		string target = headers.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+		string body = input.substr(headerEnd + 4, contentLength);
+		input.erase(0, headerEnd + 4 + contentLength);
+
+		string content;
+		int status = respond(method, target, body, content);
+
+		ostringstream response;
+		response << "HTTP/1.1 " << status << (status == 200 ? " OK" : " Not Found") << "\r\n"
+			<< "Content-Type: application/json\r\n"
+			<< "Content-Length: " << content.length() << "\r\n\r\n"
+			<< content;
+
+		const string& data = response.str();
+		size_t sent = 0;
+		while (sent < data.length())
+		{
+			ssize_t n = send(fd, data.data() + sent, data.length() - sent, 0);
+			if (n <= 0)
+				return;
+			sent += (size_t) n;
+		}
+	}
+}
+
+int CouchStandIn::respond(const string& method, const string& target, const string& body, string& response)
+{
+	Json::FastWriter writer;
+	Json::Value result;
+	const string prefix = "/" + db;
+
+	if (target.compare("/_all_dbs") == 0)
+	{
+		result.append(db);
+	}
+	else if (target.compare(prefix) == 0)
+	{
+		result["db_name"] = db;
+		result["doc_count"] = (Json::Value::UInt) docs.size();
+		result["update_seq"] = (Json::Value::UInt) docs.size();
+	}
+	else if (target.compare(0, prefix.length() + 10, prefix + "/_changes?") == 0)
+	{
+		size_t since = 0;
+		size_t sincePos = target.find("since=");
+		if (sincePos != string::npos)
+			since = (size_t) atol(target.c_str() + sincePos + 6);
+
+		result["results"] = Json::Value(Json::arrayValue);
+		for (size_t i = since; i < docs.size(); i++)
+		{
+			Json::Value change;
+			change["seq"] = (Json::Value::UInt) (i + 1);
+			change["id"] = docs[i]["_id"];
+			change["doc"] = docs[i];
+			result["results"].append(change);
+		}
+		result["last_seq"] = (Json::Value::UInt) docs.size();
+	}
+	else if (target.compare(0, prefix.length() + 11, prefix + "/_all_docs?") == 0 && method.compare("POST") == 0)
+	{
+		// bulk fetch by id
+		Json::Value request;
+		Json::Reader reader;
+		reader.parse(body, request);
+
+		const Json::Value& keys = request["keys"];
+		result["rows"] = Json::Value(Json::arrayValue);
+
+		for (Json::Value::UInt k = 0; k < keys.size(); k++)
+		{
+			Json::Value row;
+			row["key"] = keys[k];
+
+			map<string, size_t>::const_iterator found = byId.find(keys[k].asString());
+			if (found != byId.end())
+			{
+				const Json::Value& doc = docs[found->second];
+				row["id"] = doc["_id"];
+				row["value"]["rev"] = doc["_rev"];
+				row["doc"] = doc;
+			}
+			else
+				row["error"] = "not_found";
+
+			result["rows"].append(row);
+		}
+	}
+	else if (target.compare(0, prefix.length() + 11, prefix + "/_all_docs?") == 0 && target.find("startkey=%22_design") != string::npos)
+	{
+		result["rows"] = Json::Value(Json::arrayValue);
+		if (!design.isNull())
+		{
+			Json::Value row;
+			row["id"] = design["_id"];
+			row["key"] = design["_id"];
+			row["doc"] = design;
+			result["rows"].append(row);
+		}
+	}
+	else
+	{
+		response = "{\"error\":\"not_found\"}";
+		return 404;
+	}
+
+	response = writer.write(result);
+	return 200;
+}
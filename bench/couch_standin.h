@@ -0,0 +1,56 @@
+#ifndef COUCH_STANDIN_H
+#define COUCH_STANDIN_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <json/json.h>
+#include <CLucene.h>
+
+using namespace std;
+
+/**
+* Minimal HTTP server answering the CouchDB requests fti makes, for one
+* database held in memory:
+*
+*	GET  /_all_dbs
+*	GET  /<db>
+*	GET  /<db>/_all_docs?startkey=%22_design%22...   design documents
+*	GET  /<db>/_changes?since=N&include_docs=true
+*	POST /<db>/_all_docs?include_docs=true            {"keys": [...]}
+*
+* Connections are served one at a time on a background thread, which is
+* all the updater and a single threaded query process need.
+*/
+class CouchStandIn {
+private:
+	string db;
+	vector<Json::Value> docs;   // in seq order, seq is index + 1
+	map<string, size_t> byId;   // _id, index into docs
+	Json::Value design;
+	int listenFd;
+	int port;
+	bool stopping;
+	_LUCENE_THREADID_TYPE thread;
+
+	static _LUCENE_THREAD_FUNC(serve, arg);
+	void serve_connection(int fd);
+	int respond(const string& method, const string& target, const string& body, string& response);
+public:
+	CouchStandIn(const string& dbName);
+	~CouchStandIn();
+
+	// one document per line: id, title, timestamp, text separated by tabs
+	size_t load_tsv(const char* path, int repeat);
+	void add_doc(const Json::Value& doc);
+	void set_design(const Json::Value& designDoc);
+	size_t doc_count() const;
+	const Json::Value& doc(size_t i) const;
+
+	// listens on an ephemeral port on 127.0.0.1, returns false if the socket can't be opened
+	bool start();
+	void stop();
+	string url() const;
+};
+
+#endif
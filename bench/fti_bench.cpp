@@ -0,0 +1,165 @@
+/**
+* Offline benchmark: indexes a TSV corpus served by CouchStandIn with
+* CouchLuceneUpdater, then times queries against it with CouchLuceneQuery.
+*
+* usage: fti_bench <corpus.tsv> [--repeat=N] [--queries=N] [--option=value ...]
+*
+* Other --options are passed to both fti classes, e.g. --mmap=true. Queries run
+* one at a time on the calling thread, --query_threads is ignored.
+* Reports documents indexed per second, query latency percentiles and peak RSS.
+*/
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "couch_lucene.h"
+#include "stats.h"
+#include "couch_standin.h"
+
+using namespace std;
+
+static const string BENCH_DB = "bench";
+
+static Json::Value bench_design()
+{
+	Json::Value design;
+	design["_id"] = "_design/bench";
+	design["fulltext"]["by_title"]["defaults"]["store"] = "yes";
+	design["fulltext"]["by_title"]["index"] = "function(doc) { return doc.title; }";
+	design["fulltext"]["by_text"]["defaults"]["store"] = "yes";
+	design["fulltext"]["by_text"]["index"] = "function(doc) { return doc.text; }";
+	return design;
+}
+
+// words from the corpus to query for, letters only so they need no escaping
+static void pick_words(const CouchStandIn& couch, vector<string>& words)
+{
+	for (size_t i = 0; i < couch.doc_count() && words.size() < 1000; i++)
+	{
+		const string text = couch.doc(i)["text"].asString();
+		string word;
+
+		for (size_t c = 0; c <= text.length(); c++)
+		{
+			if (c < text.length() && isalpha((unsigned char) text[c]))
+				word += text[c];
+			else
+			{
+				if (word.length() >= 4)
+					words.push_back(word);
+				word.erase();
+			}
+		}
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	if (argc < 2)
+	{
+		cerr << "usage: " << argv[0] << " <corpus.tsv> [--repeat=N] [--queries=N] [--option=value ...]" << endl;
+		return 2;
+	}
+
+	Options options;
+	for (int i = 2; i < argc; i++)
+	{
+		string arg = string(argv[i]);
+		size_t eq = arg.find('=');
+
+		if (arg.compare(0, 2, "--") == 0 && eq != string::npos)
+			options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+	}
+
+	int repeat = options.count("repeat") ? atoi(options["repeat"].c_str()) : 1;
+	int queryCount = options.count("queries") ? atoi(options["queries"].c_str()) : 1000;
+
+	// measure the search, not the result cache
+	if (options.count("query_cache_bytes") == 0)
+		options["query_cache_bytes"] = "0";
+
+	// with workers handle_request only queues the request, so there would be nothing to time
+	options["query_threads"] = "1";
+
+	CouchStandIn couch(BENCH_DB);
+	if (couch.load_tsv(argv[1], repeat < 1 ? 1 : repeat) == 0)
+	{
+		cerr << "no documents in " << argv[1] << endl;
+		return 1;
+	}
+	couch.set_design(bench_design());
+
+	if (!couch.start())
+	{
+		cerr << "can't listen on 127.0.0.1" << endl;
+		return 1;
+	}
+	options["couch_host"] = couch.url();
+
+	char dirTemplate[] = "/tmp/fti_bench.XXXXXX";
+	string indexDir = string(mkdtemp(dirTemplate));
+
+	// indexing
+	CouchLuceneUpdater* updater = new CouchLuceneUpdater(&indexDir, 1000, options);
+	updater->get_design_docs();
+
+	uint64_t start = now_micros();
+	updater->handle_request("{\"type\": \"updated\", \"db\": \"" + BENCH_DB + "\"}");
+	uint64_t indexMicros = now_micros() - start;
+	delete updater;
+
+	// querying, responses go to /dev/null for the duration
+	vector<string> words;
+	pick_words(couch, words);
+	if (words.empty())
+		words.push_back("the");
+
+	fflush(stdout);
+	int savedStdout = dup(1);
+	int devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, 1);
+
+	CouchLuceneQuery* query = new CouchLuceneQuery(&indexDir, options);
+	LatencyHistogram latency;
+	ostringstream request;
+
+	start = now_micros();
+	for (int i = 0; i < queryCount; i++)
+	{
+		request.str("");
+		request << "{\"info\": {\"db_name\": \"" << BENCH_DB << "\", \"update_seq\": " << couch.doc_count() << "},"
+			<< " \"method\": \"GET\", \"path\": [\"" << BENCH_DB << "\", \"_fti\", \"by_text\"],"
+			<< " \"query\": {\"q\": \"" << words[i % words.size()] << "\", \"limit\": \"10\"}}";
+
+		uint64_t queryStart = now_micros();
+		query->handle_request(request.str());
+		latency.record(now_micros() - queryStart);
+	}
+	uint64_t queryMicros = now_micros() - start;
+	delete query;
+
+	dup2(savedStdout, 1);
+	close(devNull);
+	close(savedStdout);
+
+	couch.stop();
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("corpus:   %lu docs\n", (unsigned long) couch.doc_count());
+	printf("indexing: %.1f ms, %.0f docs/sec\n", indexMicros / 1000.0,
+		indexMicros > 0 ? couch.doc_count() * 1000000.0 / indexMicros : 0.0);
+	printf("queries:  %d in %.1f ms, %.0f queries/sec\n", queryCount, queryMicros / 1000.0,
+		queryMicros > 0 ? queryCount * 1000000.0 / queryMicros : 0.0);
+	printf("latency:  p50 %lu us, p99 %lu us, max %lu us\n", (unsigned long) latency.percentile(50),
+		(unsigned long) latency.percentile(99), (unsigned long) latency.percentile(100));
+	printf("peak rss: %ld KB\n", (long) usage.ru_maxrss);
+	printf("index:    %s\n", indexDir.c_str());
+
+	return 0;
+}
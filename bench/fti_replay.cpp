@@ -0,0 +1,397 @@
+/**
+* Replays a recorded file of external handler request lines, the JSON CouchDB
+* sends on the query process's stdin, against fti query processes and reports
+* throughput and latency. Responses can be checked against a golden file of
+* response lines, one per request, or recorded as a new golden file.
+*
+* usage: fti_replay <fti binary> <index_directory> <requests.log>
+*            [--concurrency=N] [--rate=N] [--golden=file] [--record=file]
+*            [--ignore=key,key] [--option=value ...]
+*
+* --concurrency  query processes started, as CouchDB runs several externals (default 1)
+* --rate         requests per second across all processes, 0 sends as fast as they answer (default 0);
+*                latency then counts from when each request was due, service time from when it was sent
+* --golden       fail if a response differs from the same line of this file
+* --record       write the responses to this file in request order
+* --ignore       keys removed at any depth before comparing, e.g. truncated
+* Other options are passed to the query processes.
+*/
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <json/json.h>
+#include <CLucene.h>
+
+#include "stats.h"
+
+using namespace std;
+
+// one fti query process and the pipes to it
+struct QueryProcess {
+	pid_t pid;
+	FILE* in;
+	FILE* out;
+};
+
+struct Replay {
+	vector<string> requests;
+	vector<string> responses;
+	vector<QueryProcess> processes;
+	double rate;
+	uint64_t start;
+	size_t next;
+	size_t failed;          // processes that exited early
+	LatencyHistogram latency;   // from when the request was due, so a backlog shows up
+	LatencyHistogram service;   // from when it was sent
+	_LUCENE_THREADMUTEX lock;
+};
+
+struct ReplayThread {
+	Replay* replay;
+	QueryProcess* process;
+};
+
+// a pipe whose ends aren't inherited by the other query processes, dup2 clears the flag
+// on the copies a child takes as stdin and stdout
+static bool make_pipe(int fds[2])
+{
+	if (pipe(fds) != 0)
+		return false;
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+static bool start_process(const vector<string>& args, QueryProcess& process)
+{
+	int toChild[2];
+	int fromChild[2];
+
+	if (!make_pipe(toChild) || !make_pipe(fromChild))
+		return false;
+
+	process.pid = fork();
+	if (process.pid < 0)
+		return false;
+
+	if (process.pid == 0)
+	{
+		dup2(toChild[0], 0);
+		dup2(fromChild[1], 1);
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+
+		vector<char*> argv;
+		for (size_t i = 0; i < args.size(); i++)
+			argv.push_back((char*) args[i].c_str());
+		argv.push_back(NULL);
+
+		execv(argv[0], &argv[0]);
+		_exit(127);
+	}
+
+	close(toChild[0]);
+	close(fromChild[1]);
+	process.in = fdopen(toChild[1], "w");
+	process.out = fdopen(fromChild[0], "r");
+
+	return true;
+}
+
+static bool read_line(FILE* file, string& line)
+{
+	line.erase();
+
+	int c;
+	while ((c = fgetc(file)) != EOF)
+	{
+		if (c == '\n')
+			return true;
+		line += (char) c;
+	}
+
+	return line.length() > 0;
+}
+
+static _LUCENE_THREAD_FUNC(replay_requests, arg)
+{
+	ReplayThread* thread = (ReplayThread*) arg;
+	Replay* replay = thread->replay;
+	QueryProcess* process = thread->process;
+	string response;
+
+	while (true)
+	{
+		size_t i;
+		{
+			SCOPED_LOCK_MUTEX(replay->lock);
+			if (replay->next >= replay->requests.size())
+				break;
+			i = replay->next++;
+		}
+
+		// request i is due i / rate seconds after the start, whichever process sends it
+		uint64_t due = 0;
+		if (replay->rate > 0)
+		{
+			due = replay->start + (uint64_t) (i * 1000000.0 / replay->rate);
+			uint64_t now = now_micros();
+			if (due > now)
+				usleep((useconds_t) (due - now));
+		}
+
+		uint64_t sent = now_micros();
+
+		// without a rate there is no schedule to fall behind
+		if (due == 0 || due > sent)
+			due = sent;
+		fputs(replay->requests[i].c_str(), process->in);
+		fputc('\n', process->in);
+		fflush(process->in);
+
+		if (!read_line(process->out, response))
+		{
+			SCOPED_LOCK_MUTEX(replay->lock);
+			replay->failed++;
+			break;
+		}
+
+		uint64_t answered = now_micros();
+
+		SCOPED_LOCK_MUTEX(replay->lock);
+		replay->latency.record(answered - due);
+		replay->service.record(answered - sent);
+		replay->responses[i] = response;
+	}
+
+	_LUCENE_THREAD_FUNC_RETURN(0);
+}
+
+static void remove_keys(Json::Value& value, const vector<string>& keys)
+{
+	if (value.isObject())
+	{
+		for (size_t k = 0; k < keys.size(); k++)
+			value.removeMember(keys[k]);
+
+		vector<string> names = value.getMemberNames();
+		for (size_t n = 0; n < names.size(); n++)
+			remove_keys(value[names[n]], keys);
+	}
+	else if (value.isArray())
+	{
+		for (Json::Value::UInt i = 0; i < value.size(); i++)
+			remove_keys(value[i], keys);
+	}
+}
+
+// responses are compared as JSON so key order and number formatting don't matter
+static bool same_response(const string& response, const string& golden, const vector<string>& ignore)
+{
+	Json::Reader reader;
+	Json::Value actual;
+	Json::Value expected;
+
+	if (!reader.parse(response, actual) || !reader.parse(golden, expected))
+		return response.compare(golden) == 0;
+
+	remove_keys(actual, ignore);
+	remove_keys(expected, ignore);
+
+	return actual == expected;
+}
+
+static bool read_lines(const char* path, vector<string>& lines)
+{
+	ifstream file(path);
+	if (!file)
+		return false;
+
+	string line;
+	while (getline(file, line))
+	{
+		if (line.length() > 0)
+			lines.push_back(line);
+	}
+
+	return true;
+}
+
+int main(int argc, const char* argv[])
+{
+	if (argc < 4)
+	{
+		cerr << "usage: " << argv[0] << " <fti binary> <index_directory> <requests.log>"
+			<< " [--concurrency=N] [--rate=N] [--golden=file] [--record=file] [--ignore=key,key] [--option=value ...]" << endl;
+		return 2;
+	}
+
+	int concurrency = 1;
+	string golden;
+	string record;
+	vector<string> ignore;
+	Replay replay;
+	replay.rate = 0;
+	replay.next = 0;
+	replay.failed = 0;
+
+	vector<string> args;
+	args.push_back(argv[1]);
+	args.push_back(argv[2]);
+	args.push_back("query");
+
+	for (int i = 4; i < argc; i++)
+	{
+		string arg = string(argv[i]);
+		size_t eq = arg.find('=');
+		string name = (eq != string::npos) ? arg.substr(2, eq - 2) : arg.substr(2);
+		string value = (eq != string::npos) ? arg.substr(eq + 1) : "";
+
+		if (name.compare("concurrency") == 0)
+			concurrency = atoi(value.c_str());
+		else if (name.compare("rate") == 0)
+			replay.rate = atof(value.c_str());
+		else if (name.compare("golden") == 0)
+			golden = value;
+		else if (name.compare("record") == 0)
+			record = value;
+		else if (name.compare("ignore") == 0)
+		{
+			size_t start = 0;
+			size_t comma;
+			while ((comma = value.find(',', start)) != string::npos)
+			{
+				ignore.push_back(value.substr(start, comma - start));
+				start = comma + 1;
+			}
+			ignore.push_back(value.substr(start));
+		}
+		else
+			args.push_back(arg);
+	}
+
+	if (concurrency < 1)
+		concurrency = 1;
+
+	if (!read_lines(argv[3], replay.requests) || replay.requests.empty())
+	{
+		cerr << "no requests in " << argv[3] << endl;
+		return 2;
+	}
+	replay.responses.resize(replay.requests.size());
+
+	vector<string> expected;
+	if (golden.length() > 0 && !read_lines(golden.c_str(), expected))
+	{
+		cerr << "can't read " << golden << endl;
+		return 2;
+	}
+
+	// a process that dies shows up as a short read, not a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	replay.processes.resize(concurrency);
+	for (int p = 0; p < concurrency; p++)
+	{
+		if (!start_process(args, replay.processes[p]))
+		{
+			cerr << "can't start " << argv[1] << endl;
+			return 1;
+		}
+	}
+
+	vector<ReplayThread> threads(concurrency);
+	vector<_LUCENE_THREADID_TYPE> ids(concurrency);
+
+	replay.start = now_micros();
+	for (int p = 0; p < concurrency; p++)
+	{
+		threads[p].replay = &replay;
+		threads[p].process = &replay.processes[p];
+		ids[p] = _LUCENE_THREAD_CREATE(&replay_requests, &threads[p]);
+	}
+
+	for (int p = 0; p < concurrency; p++)
+		_LUCENE_THREAD_JOIN(ids[p]);
+	uint64_t elapsed = now_micros() - replay.start;
+
+	// an empty line stops fti
+	for (int p = 0; p < concurrency; p++)
+	{
+		fputc('\n', replay.processes[p].in);
+		fclose(replay.processes[p].in);
+		fclose(replay.processes[p].out);
+		waitpid(replay.processes[p].pid, NULL, 0);
+	}
+
+	size_t answered = 0;
+	size_t errors = 0;
+	size_t mismatches = 0;
+	Json::Reader reader;
+
+	for (size_t i = 0; i < replay.responses.size(); i++)
+	{
+		const string& response = replay.responses[i];
+		if (response.length() == 0)
+			continue;
+		answered++;
+
+		Json::Value root;
+		if (!reader.parse(response, root) || (root.isObject() && root.isMember("code") && root["code"].asInt() != 200))
+			errors++;
+
+		if (golden.length() > 0)
+		{
+			if (i >= expected.size() || !same_response(response, expected[i], ignore))
+			{
+				if (mismatches < 10)
+					cerr << "line " << (i + 1) << " differs" << endl
+						<< "  expected: " << (i < expected.size() ? expected[i] : string("(missing)")) << endl
+						<< "  actual:   " << response << endl;
+				mismatches++;
+			}
+		}
+	}
+
+	if (record.length() > 0)
+	{
+		ofstream file(record.c_str());
+		for (size_t i = 0; i < replay.responses.size(); i++)
+			file << replay.responses[i] << '\n';
+	}
+
+	printf("requests:   %lu sent, %lu answered, %lu errors\n", (unsigned long) replay.requests.size(),
+		(unsigned long) answered, (unsigned long) errors);
+	printf("throughput: %.1f requests/sec over %.1f ms with %d processes\n",
+		elapsed > 0 ? answered * 1000000.0 / elapsed : 0.0, elapsed / 1000.0, concurrency);
+	printf("latency:    p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+		(unsigned long) replay.latency.percentile(50), (unsigned long) replay.latency.percentile(90),
+		(unsigned long) replay.latency.percentile(99), (unsigned long) replay.latency.percentile(99.9),
+		(unsigned long) replay.latency.percentile(100));
+	if (replay.rate > 0)
+		printf("service:    p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us (from the actual send)\n",
+			(unsigned long) replay.service.percentile(50), (unsigned long) replay.service.percentile(90),
+			(unsigned long) replay.service.percentile(99), (unsigned long) replay.service.percentile(99.9),
+			(unsigned long) replay.service.percentile(100));
+	if (golden.length() > 0)
+		printf("golden:     %lu of %lu responses differ from %s\n", (unsigned long) mismatches,
+			(unsigned long) replay.requests.size(), golden.c_str());
+
+	if (answered < replay.requests.size() || replay.failed > 0 || mismatches > 0)
+		return 1;
+
+	return 0;
+}
@@ -1,15 +1,22 @@
 #include <curl/curl.h>
+#include <wctype.h>
 
 #include "couch_lucene.h"
+#include "utf8.h"
+#include "highlighter.h"
 
 #ifdef _MSC_VER
     #include <direct.h>
+    #include <io.h>
     #define RMDIR(d) _rmdir(d)
+    #define MKDIR(d) _mkdir(d)
 #elif unix
     #include <unistd.h>
+    #include <dirent.h>
     #include <sys/stat.h>
     #include <sys/types.h>
     #define RMDIR(d) rmdir(d)
+    #define MKDIR(d) mkdir(d, 0777)
 #endif
 
 using namespace lucene::index;
@@ -26,6 +33,9 @@ static const wstring WSEQ_NUM_FIELD  = L"_seq_num";
 static const wstring WID_FIELD  = L"_id";
 static const wstring WSEQ_NUM_PREFIX  = L"seq";
 
+// a deleted db's index directory is renamed to <db>.deleted-<time> until its files are removed
+static const string TOMBSTONE_SUFFIX  = ".deleted-";
+
 /****************************************************
 * Static Functions
 ****************************************************/
@@ -42,11 +52,107 @@ size_t curl_write( void *ptr, size_t size, size_t nmemb, void *stream)
 	return size * nmemb;
 }
 
-char wide_to_narrow(TCHAR w)
+// query string values arrive from CouchDB as strings, e.g. "skip":"10"
+static int query_int(const Json::Value& value, int def)
+{
+	if (value.isString())
+		return atoi(value.asCString());
+	// asInt throws for numbers out of range, they are treated as missing
+	else if (value.isInt())
+		return value.asInt();
+
+	return def;
+}
+
+static bool query_bool(const Json::Value& value, bool def)
+{
+	if (value.isString())
+		return value.asString().compare("true") == 0;
+	else if (value.isBool())
+		return value.asBool();
+
+	return def;
+}
+
+// every prefix of each whitespace separated token up to max characters, separated by spaces
+static void edge_ngrams(const wstring& value, size_t max, wstring& ngrams)
+{
+	ngrams.erase();
+	size_t pos = 0;
+
+	while (pos < value.length())
+	{
+		while (pos < value.length() && iswspace(value[pos]))
+			pos++;
+
+		size_t start = pos;
+		while (pos < value.length() && !iswspace(value[pos]))
+			pos++;
+
+		for (size_t length = 1; length <= max && start + length <= pos; length++)
+		{
+			ngrams.append(value, start, length);
+			ngrams += L' ';
+		}
+	}
+}
+
+// every member path in required is present and not null, e.g. {"tags": [...]} for "tags"
+static bool has_members(const Json::Value& doc, const vector< vector<string> >& required)
+{
+	for (size_t p = 0; p < required.size(); p++)
+	{
+		const Json::Value* value = &doc;
+
+		for (size_t k = 0; k < required[p].size(); k++)
+		{
+			if (!value->isObject() || !value->isMember(required[p][k]))
+				return false;
+
+			value = &(*value)[required[p][k]];
+		}
+
+		if (value->isNull())
+			return false;
+	}
+
+	return true;
+}
+
+// one string, or a JSON array of strings e.g. fq=["a:b","c:d"]
+static void query_strings(const Json::Value& value, vector<string>& strings)
 {
-    // simple typecast
-    // works because UNICODE incorporates ASCII into itself
-    return char(w);
+	strings.clear();
+
+	if (value.isString())
+	{
+		const string str = value.asString();
+		Json::Value items;
+		Json::Reader rdr;
+
+		if (str.length() > 0 && str[0] == '[' && rdr.parse(str, items) && items.isArray())
+		{
+			for (Json::Value::UInt i = 0; i < items.size(); i++)
+			{
+				if (items[i].isString())
+					strings.push_back(items[i].asString());
+			}
+		}
+		else if (str.length() > 0)
+			strings.push_back(str);
+	}
+	else if (value.isArray())
+	{
+		// POST batches can send a real array
+		for (Json::Value::UInt i = 0; i < value.size(); i++)
+		{
+			if (value[i].isString())
+				strings.push_back(value[i].asString());
+		}
+	}
+
+	sort(strings.begin(), strings.end());
+	strings.erase(unique(strings.begin(), strings.end()), strings.end());
 }
 
 /* The class of the global object. */
@@ -96,36 +202,211 @@ void CouchLucene::handle_request(const string &request)
     istringstream requeststream(request); 
 	bool parsingSuccessful = reader.parse(requeststream, root);
 
-    Json::Value response;
-    
 	if (parsingSuccessful)
 	{
 		// echo request back to caller
 		// {"code": 200, "json": request, "headers": {}})
-		response["code"] = 200;
-		response["json"] = root;
+		out.begin_object();
+		out.key("code").number(200);
+		out.key("json").value(root);
+		out.end_object();
+		out.flush();
 	}
 	else
 	{
-        response["code"] = 400;
-        response["body"] = reader.getFormatedErrorMessages();
-        
+		write_error(reader.getFormatedErrorMessages(), 400);
+	}
+}
+
+// a file or folder in the index folder, which may be given with or without a trailing '/'
+string CouchLucene::dir_path(const string &name)
+{
+	string path = *indexDir;
+
+	if (path.length() == 0 || path[path.length() - 1] != '/')
+		path += "/";
+
+	return path + name;
+}
+
+string CouchLucene::index_path(const string &db)
+{
+	return dir_path(db);
+}
+
+// base urls end in '/' so paths can be appended
+static string host_url(const string& url)
+{
+	if (url.length() == 0 || url[url.length() - 1] != '/')
+		return url + '/';
+
+	return url;
+}
+
+// --couch_host points both processes at another server, e.g. the benchmark's stand-in
+// --couch_replicas=url,url        read replicas for document fetches
+// --couch_user, --couch_password  basic auth, or --couch_password_file to keep it off the command line
+// --couch_connect_timeout=ms, --couch_timeout=ms
+void CouchLucene::read_couch_host()
+{
+	couchHost = host_url(get_option("couch_host", COUCH_HOST));
+
+	string replicas = get_option("couch_replicas", "");
+	size_t start = 0;
+	while (start < replicas.length())
+	{
+		size_t comma = replicas.find(',', start);
+		if (comma == string::npos)
+			comma = replicas.length();
+
+		if (comma > start)
+			couchReplicas.push_back(host_url(replicas.substr(start, comma - start)));
+		start = comma + 1;
 	}
 
-    Json::FastWriter writer;
-    // Make a new JSON document.
-    std::string output = writer.write( response );
-    cout << output.c_str() << endl;
+	string user = get_option("couch_user", "");
+	string password = get_option("couch_password", "");
+
+	string passwordFile = get_option("couch_password_file", "");
+	if (passwordFile.length() > 0)
+	{
+		ifstream file(passwordFile.c_str());
+		getline(file, password);
+	}
+
+	if (user.length() > 0)
+		couchCredentials = user + ":" + password;
+
+	couchConnectTimeout = get_long_option("couch_connect_timeout", 0);
+	couchTimeout = get_long_option("couch_timeout", 0);
+	nextReplica = 0;
+}
+
+// auth and timeouts for every request to CouchDB, a continuous feed has no overall timeout
+void CouchLucene::prepare_handle(CURL* handle, bool timeout)
+{
+	// timeouts must not use signals once requests run on worker threads
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+
+	if (couchConnectTimeout > 0)
+		curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, couchConnectTimeout);
+	if (timeout && couchTimeout > 0)
+		curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, couchTimeout);
+	if (couchCredentials.length() > 0)
+	{
+		curl_easy_setopt(handle, CURLOPT_HTTPAUTH, (long) CURLAUTH_BASIC);
+		curl_easy_setopt(handle, CURLOPT_USERPWD, couchCredentials.c_str());
+	}
+}
+
+// GETs (or POSTs, when the handle is set up for it) couchHost + path into body, moving
+// on to the next endpoint the route allows when one can't be reached or returns a 5xx
+CURLcode CouchLucene::couch_request(CURL* handle, const string &path, string &body, CouchRoute route)
+{
+	vector<const string*> hosts;
+
+	if (route == REPLICA_FIRST && !couchReplicas.empty())
+	{
+		// replicas take reads in turn
+		size_t first;
+		{
+			SCOPED_LOCK_MUTEX(hostLock);
+			first = (size_t) (nextReplica++ % couchReplicas.size());
+		}
+
+		for (size_t i = 0; i < couchReplicas.size(); i++)
+			hosts.push_back(&couchReplicas[(first + i) % couchReplicas.size()]);
+		hosts.push_back(&couchHost);
+	}
+	else
+	{
+		hosts.push_back(&couchHost);
+
+		if (route != PRIMARY_ONLY)
+		{
+			for (size_t i = 0; i < couchReplicas.size(); i++)
+				hosts.push_back(&couchReplicas[i]);
+		}
+	}
+
+	struct write_result result;
+	CURLcode res = CURLE_COULDNT_CONNECT;
+
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, curl_write);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &result);
+	prepare_handle(handle, true);
+
+	for (size_t h = 0; h < hosts.size(); h++)
+	{
+		const string url = *hosts[h] + path;
+		result.buffer.erase();
+
+		curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+		res = curl_easy_perform(handle);
+
+		long status = 0;
+		if (res == CURLE_OK)
+			curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+
+		// a replica that hasn't caught up answers 404 for a doc the primary has, the primary is last
+		bool lagging = (route == REPLICA_FIRST && status == 404 && h + 1 < hosts.size());
+
+		if (res == CURLE_OK && status < 500 && !lagging)
+			break;
+
+		if (h + 1 < hosts.size())
+			stats.increment("couch_failovers");
+	}
+
+	body.swap(result.buffer);
+	return res;
+}
+
+// the updater's stats, read by the query process for _stats
+string CouchLucene::stats_path()
+{
+	return dir_path("_stats.json");
+}
+
+string CouchLucene::get_option(const char* name, const string &def)
+{
+	Options::const_iterator itr = options.find(name);
+	if (itr != options.end())
+		return itr->second;
+
+	return def;
+}
+
+long CouchLucene::get_long_option(const char* name, long def)
+{
+	Options::const_iterator itr = options.find(name);
+	if (itr != options.end())
+		return atol(itr->second.c_str());
+
+	return def;
+}
+
+bool CouchLucene::get_bool_option(const char* name, bool def)
+{
+	Options::const_iterator itr = options.find(name);
+	if (itr != options.end())
+		return itr->second.compare("true") == 0 || itr->second.compare("1") == 0 || itr->second.compare("yes") == 0;
+
+	return def;
 }
+
 void CouchLucene::write_error(const string &err, int code)
 {
-	Json::Value response;
-    response["code"] = code;
-    response["body"] = err;
-    Json::FastWriter writer;
-    // Make a new JSON document.
-    std::string output = writer.write( response );
-    cout << output.c_str() << endl;
+	write_error(out, err, code);
+}
+
+void CouchLucene::write_error(ResponseWriter &writer, const string &err, int code)
+{
+	writer.begin_object();
+	writer.key("code").number(code);
+	writer.key("body").string_value(err);
+	writer.end_object();
+	writer.flush();
 }
 
 /***************************************************
@@ -133,19 +414,47 @@ void CouchLucene::write_error(const string &err, int code)
 * CouchLuceneUpdater
 *
 *****************************************************/
-CouchLuceneUpdater::CouchLuceneUpdater(string* dir, int count)
+CouchLuceneUpdater::CouchLuceneUpdater(string* dir, int count, const Options &opts)
 {
 	indexDir = dir;
+	options = opts;
 	optimize_count = count;
+	read_couch_host();
+
+	// --replica_changes=true reads _changes from the replicas too, for servers that share sequence numbers
+	changesRoute = get_bool_option("replica_changes", false) ? REPLICA_FIRST : PRIMARY_ONLY;
+
+	// --design_memory_bytes bounds the definitions kept loaded, 0 for no limit
+	loadedBytes = 0;
+	loadedBudget = (size_t) get_long_option("design_memory_bytes", 0);
+
+	designCache = Json::Value(Json::objectValue);
+
+	removerStarted = false;
+	removerStopping = false;
+	sweep_tombstones();
+
+	// runtime sizing and gc cadence, the defaults match the original fixed values
+	// --js_runtime_bytes   maximum GC heap before the runtime collects (8MB)
+	// --js_stack_chunk     context stack chunk size (8192)
+	// --js_gc_docs         call JS_MaybeGC every N documents (1)
+	// --js_gc_bytes        or after N bytes of document JSON (0, disabled)
+	long runtime_bytes = get_long_option("js_runtime_bytes", 8L * 1024L * 1024L);
+	long stack_chunk = get_long_option("js_stack_chunk", 8192);
+	gc_every_docs = get_long_option("js_gc_docs", 1);
+	gc_every_bytes = get_long_option("js_gc_bytes", 0);
+	gc_docs = 0;
+	gc_bytes = 0;
+	memset(&js_stats, 0, sizeof(js_stats));
 
 	// initialise the js engine
 	 /* Create a JS runtime. */
-    rt = JS_NewRuntime(8L * 1024L * 1024L);
+    rt = JS_NewRuntime((uint32) runtime_bytes);
     if (rt == NULL)
    	  write_error("Error creating JS Runtime", 500);
 
     /* Create a context. */
-    cx = JS_NewContext(rt, 8192);
+    cx = JS_NewContext(rt, (size_t) stack_chunk);
     if (cx == NULL)
 		write_error("Error creating JS Context", 500);
 
@@ -167,11 +476,49 @@ CouchLuceneUpdater::CouchLuceneUpdater(string* dir, int count)
 
 CouchLuceneUpdater::~CouchLuceneUpdater()
 {
+	if (removerStarted)
+	{
+		{
+			SCOPED_LOCK_MUTEX(tombstoneLock);
+			removerStopping = true;
+			CONDITION_NOTIFYALL(tombstoneCondition);
+		}
+
+		_LUCENE_THREAD_JOIN(remover);
+	}
+
     JS_DestroyContext(cx);
     JS_DestroyRuntime(rt);
     JS_ShutDown();
 }
 
+void CouchLuceneUpdater::maybe_gc(size_t doc_bytes)
+{
+	js_stats.docs++;
+	gc_docs++;
+	gc_bytes += (long) doc_bytes;
+
+	if ((gc_every_docs > 0 && gc_docs >= gc_every_docs) || (gc_every_bytes > 0 && gc_bytes >= gc_every_bytes))
+	{
+		uint64_t start = Misc::currentTimeMillis();
+		JS_MaybeGC(cx);
+		js_stats.gc_time_ms += Misc::currentTimeMillis() - start;
+		js_stats.gc_checks++;
+
+		js_stats.heap_bytes = JS_GetGCParameter(rt, JSGC_BYTES);
+		if (js_stats.heap_bytes > js_stats.peak_heap_bytes)
+			js_stats.peak_heap_bytes = js_stats.heap_bytes;
+
+		gc_docs = 0;
+		gc_bytes = 0;
+	}
+}
+
+const JsStats& CouchLuceneUpdater::get_js_stats() const
+{
+	return js_stats;
+}
+
 void CouchLuceneUpdater::handle_request(const string &request)
 {
 	// { "type" : "updated", "db" : "test" } }
@@ -180,7 +527,6 @@ void CouchLuceneUpdater::handle_request(const string &request)
 	Json::Reader reader;
 	istringstream requeststream(request); 
 	bool parsingSuccessful = reader.parse(requeststream, root);
-	std::stringstream tmpStr;
 
 	if (parsingSuccessful)
 	{
@@ -208,53 +554,186 @@ void CouchLuceneUpdater::handle_request(const string &request)
 			else
 				updateCntrMap[dbName] = 0; // first time through, count from zero
 
+			// definitions are loaded the first time a db is updated
+			ensure_design_docs(NULL, dbName, false);
 			update_index(dbName);
 
 		}
 		else if (type.compare("deleted") == 0)
 		{
-			// delete clucene index
-			if ((this->indexDir->c_str())[indexDir->length() - 1] == '/')
-				tmpStr << indexDir->c_str() << dbName.c_str();
-			else
-				tmpStr << indexDir->c_str() << "/" << dbName.c_str();
+			delete_index(dbName);
+		}
+		else
+		{
+			write_error("message type not recognised", 400);
+		}
 
-			const std::string& tmp = tmpStr.str();
-			const char* target = tmp.c_str();
+		save_stats();
+		save_design_cache();
+	}
+	else
+	{
+		write_error(reader.getFormatedErrorMessages(), 400);
+	}
+}
 
-			if (IndexReader::indexExists(target) != false)
-			{
-				WhitespaceAnalyzer an;
-				IndexWriter* writer = _CLNEW IndexWriter(target, &an, true);
+void CouchLuceneUpdater::delete_index(const string& dbName)
+{
+	const string target = index_path(dbName);
 
-				Directory* dir = writer->getDirectory();
-				vector<string> allFiles;
-			    dir->list(allFiles);
+	if (IndexReader::indexExists(target.c_str()) != false)
+	{
+		// renaming is atomic, so the index is either whole or gone and a crash can't leave half
+		// of it for IndexReader::open to trip over; the files are removed in the background
+		ostringstream tombstone;
+		tombstone << target << TOMBSTONE_SUFFIX << (unsigned long) Misc::currentTimeMillis();
 
-				for (vector<string>::iterator it = allFiles.begin(); it!=allFiles.end(); ++it) {
-					dir->deleteFile(it->c_str(), false);
-				}
+		if (rename(target.c_str(), tombstone.str().c_str()) == 0)
+			queue_tombstone(tombstone.str());
+		else
+			write_error("error removing index for " + dbName, 500);
 
-				writer->close();
-				_CLDELETE(writer);
+		// remove updateCntrMap entry for this db
+		updateCntrMap.erase(dbName);
+	}
+	else
+	{
+		// a db without an index can still have a folder holding its design cache
+		remove(design_cache_path(dbName).c_str());
+		RMDIR(target.c_str());
+	}
 
-				// remove the directory
-				RMDIR(target);
-				
-				// remove updateCntrMap entry for this db
-				updateCntrMap.erase(dbName);
+	// the db's definitions go with it, their file went with the folder
+	unload_design_docs(dbName);
+	designCache.removeMember(dbName);
+	dirtyDesigns.erase(dbName);
+}
 
-			}
+void CouchLuceneUpdater::queue_tombstone(const string& path)
+{
+	SCOPED_LOCK_MUTEX(tombstoneLock);
 
-		}
-		else
+	tombstones.push_back(path);
+
+	if (!removerStarted)
+	{
+		remover = _LUCENE_THREAD_CREATE(&remove_tombstones, this);
+		removerStarted = true;
+	}
+
+	CONDITION_NOTIFYALL(tombstoneCondition);
+}
+
+// names of the entries in dir, directories included; Misc::listFiles skips them
+static void list_entries(const string& dir, vector<string>& names)
+{
+#ifdef _MSC_VER
+	struct _finddata_t entry;
+	intptr_t find = _findfirst((dir + "/*").c_str(), &entry);
+	if (find == -1)
+		return;
+
+	do {
+		if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0)
+			names.push_back(entry.name);
+	} while (_findnext(find, &entry) == 0);
+
+	_findclose(find);
+#else
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL)
+		return;
+
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			names.push_back(entry->d_name);
+	}
+
+	closedir(d);
+#endif
+}
+
+// tombstones left by a process that stopped before removing them
+void CouchLuceneUpdater::sweep_tombstones()
+{
+	vector<string> names;
+	list_entries(*indexDir, names);
+
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (names[i].find(TOMBSTONE_SUFFIX) != string::npos)
+			queue_tombstone(index_path(names[i]));
+	}
+}
+
+_LUCENE_THREAD_FUNC(CouchLuceneUpdater::remove_tombstones, arg)
+{
+	CouchLuceneUpdater* updater = (CouchLuceneUpdater*) arg;
+
+	while (true)
+	{
+		string path;
 		{
-			write_error("message type not recognised", 400);
+			SCOPED_LOCK_MUTEX(updater->tombstoneLock);
+
+			while (updater->tombstones.empty() && !updater->removerStopping)
+				CONDITION_WAIT(updater->tombstoneLock, updater->tombstoneCondition);
+
+			// anything still queued is swept up by the next process
+			if (updater->removerStopping)
+				break;
+
+			path = updater->tombstones.front();
+			updater->tombstones.pop_front();
 		}
+
+		vector<string> files;
+		Misc::listFiles(path.c_str(), files, true);
+
+		for (size_t i = 0; i < files.size(); i++)
+			remove(files[i].c_str());
+
+		RMDIR(path.c_str());
+		updater->stats.increment("tombstones_removed");
 	}
-	else
+
+	_LUCENE_THREAD_FUNC_RETURN(0);
+}
+
+void CouchLuceneUpdater::save_stats()
+{
+	stats.set("js_heap_bytes", js_stats.heap_bytes);
+	stats.set("js_peak_heap_bytes", js_stats.peak_heap_bytes);
+	stats.set("js_gc_checks", js_stats.gc_checks);
+	stats.set("js_gc_time_ms", (int64_t) js_stats.gc_time_ms);
+	stats.set("loaded_dbs", (int64_t) loadedDbs.size());
+	stats.set("loaded_design_bytes", (int64_t) loadedBytes);
+
+	ResponseWriter snapshot;
+	snapshot.begin_object();
+	stats.write(snapshot);
+	snapshot.end_object();
+
+	// written beside the indexes and renamed into place, so a reader never sees half a file
+	const string path = stats_path();
+	const string tmp = path + ".tmp";
+
+	FILE* file = fopen(tmp.c_str(), "wb");
+	if (file != NULL)
 	{
-		write_error(reader.getFormatedErrorMessages(), 400);
+		size_t written = fwrite(snapshot.str().data(), 1, snapshot.str().length(), file);
+		fclose(file);
+
+		if (written == snapshot.str().length())
+		{
+			// rename replaces the old file atomically on POSIX, Windows won't rename over it
+#ifdef _MSC_VER
+			remove(path.c_str());
+#endif
+			rename(tmp.c_str(), path.c_str());
+		}
 	}
 }
 
@@ -262,14 +741,8 @@ void CouchLuceneUpdater::optimize(string index)
 {
 	IndexReader* reader = NULL;
 	WhitespaceAnalyzer an;
-	std::stringstream tmpStr;
-
-	if ((this->indexDir->c_str())[indexDir->length() - 1] == '/')
-		tmpStr << indexDir->c_str() << index.c_str();
-	else
-		tmpStr << indexDir->c_str() << "/" << index.c_str();
 
-	const std::string& tmp = tmpStr.str();
+	const std::string tmp = index_path(index);
 	const char* target = tmp.c_str();
 
 	if (IndexReader::indexExists(target) == false)
@@ -282,29 +755,39 @@ void CouchLuceneUpdater::optimize(string index)
 	else
 	{
 		// optimise the index
+		StatsTimer timer(stats, "optimize");
 		IndexWriter *writer = _CLNEW IndexWriter(target, &an, false);
 		writer->optimize();
 		writer->close();
 		_CLDELETE(writer);
 
+		stats.increment("merges");
+		stats.set("last_optimize." + index, (int64_t) Misc::currentTimeMillis());
 	}
 
 }
 
 void CouchLuceneUpdater::update_index(string index)
+{
+	const std::string tmp = index_path(index);
+	const char* target = tmp.c_str();
+
+	string seq_num = read_seq_num(target, true);
+
+	// index files
+	// fetch changes from couchdb
+	long last_seq_num = addChanges(target, seq_num.c_str(), &index);
+	stats.set("last_seq." + index, last_seq_num);
+
+	put_seq_num(target, last_seq_num);
+}
+
+// creates the index if needed and returns the last sequence number indexed,
+// optionally removing the config doc holding it for put_seq_num to add back
+string CouchLuceneUpdater::read_seq_num(const char* target, bool remove)
 {
 	IndexReader* reader = NULL;
 	WhitespaceAnalyzer an;
-	std::stringstream tmpStr;
-	std::wostringstream wTmpStr;
-	
-	if ((this->indexDir->c_str())[indexDir->length() - 1] == '/')
-		tmpStr << indexDir->c_str() << index.c_str();
-	else
-		tmpStr << indexDir->c_str() << "/" << index.c_str();
-
-	const std::string& tmp = tmpStr.str();
-	const char* target = tmp.c_str();
 
 	if (IndexReader::indexExists(target) == false)
 	{
@@ -319,13 +802,8 @@ void CouchLuceneUpdater::update_index(string index)
 	IndexSearcher searcher(reader);
 
 	QueryParser* qp = _CLNEW QueryParser(WSEQ_NUM_FIELD.c_str(), &an);
-		
-	// clear
-	wTmpStr.clear();
-	wTmpStr.str();
-	wTmpStr << WSEQ_NUM_PREFIX.c_str() << "*";	
 
-	const std::wstring& wtmp = wTmpStr.str();
+	const std::wstring wtmp = WSEQ_NUM_PREFIX + L"*";
 	const TCHAR* wquery_string = wtmp.c_str();
 	Query* q = qp->parse(wquery_string);
 	Hits* h = searcher.search(q);
@@ -336,30 +814,25 @@ void CouchLuceneUpdater::update_index(string index)
 	{
 		Document* doc = &h->doc(0);
 		// parse seq number
-		// clear
-		wTmpStr.clear();
-		wTmpStr.str(std::wstring());
-		
-		wTmpStr << doc->getField(WSEQ_NUM_FIELD.c_str())->stringValue();
-        wstring wResult = wTmpStr.str();
-		wResult.erase(0, WSEQ_NUM_PREFIX.length());
-		
-        seq_num = string(wResult.length(), ' ');
-        transform(wResult.begin(), wResult.end(), seq_num.begin(), wide_to_narrow);
+		tchar_to_utf8(doc->getField(WSEQ_NUM_FIELD.c_str())->stringValue(), seq_num);
+		seq_num.erase(0, WSEQ_NUM_PREFIX.length());
 
-		// delete existing config doc as we are going to add it again with an updated number
-		Term* t1 = _CLNEW Term(WSEQ_NUM_FIELD.c_str(), doc->getField(WSEQ_NUM_FIELD.c_str())->stringValue());		
-		reader->deleteDocuments(t1);
+		if (remove)
+		{
+			// delete existing config doc as we are going to add it again with an updated number
+			Term* t1 = _CLNEW Term(WSEQ_NUM_FIELD.c_str(), doc->getField(WSEQ_NUM_FIELD.c_str())->stringValue());
+			reader->deleteDocuments(t1);
 
-		reader->flush();
+			reader->flush();
 
-		_CLDECDELETE(t1);
+			_CLDECDELETE(t1);
+		}
 	}
 	else
 	{
 		seq_num = "0";
 	}
-	
+
 	_CLDELETE(h);
 	_CLDELETE(q);
 	_CLLDELETE(qp);
@@ -368,18 +841,27 @@ void CouchLuceneUpdater::update_index(string index)
 	reader->close();
 	_CLDELETE(reader);
 
-	// index files
-	// fetch changes from couchdb
-	wostringstream wseq;
-	wseq << seq_num.c_str();
+	return seq_num;
+}
 
-	long last_seq_num = addChanges(target, seq_num.c_str(), &index);
+// the config doc's term, seq<N>
+static void seq_term(long seq, wstring& term)
+{
+	char seq_str[32];
+	sprintf(seq_str, "%ld", seq);
+
+	utf8_to_tchar(seq_str, strlen(seq_str), term);
+	term.insert(0, WSEQ_NUM_PREFIX);
+}
+
+void CouchLuceneUpdater::put_seq_num(const char* target, long last_seq_num)
+{
+	WhitespaceAnalyzer an;
 
-	wostringstream wstream;
-	wstream << WSEQ_NUM_PREFIX.c_str() << last_seq_num;
-	const wstring wlast_seq_num = wstream.str();
+	wstring wlast_seq_num;
+	seq_term(last_seq_num, wlast_seq_num);
 
-	// add a new couch config doc	
+	// add a new couch config doc
 	Document config;
 	config.add(*_CLNEW Field(WSEQ_NUM_FIELD.c_str(), wlast_seq_num.c_str(), Field::STORE_YES | Field::INDEX_UNTOKENIZED));
 	write_doc(target, &config, &an, false);
@@ -399,29 +881,22 @@ long CouchLuceneUpdater::addChanges(const char* target, const char* since_seq_nu
   CURL *curl_handle;
   CURLcode res;
   stringstream url;
-  wostringstream query;
-  WhitespaceAnalyzer an;
-  IndexReader* reader;
   long last_seq_num = 0;
 
   curl_handle = curl_easy_init();
-  if (curl_handle) 
+  if (curl_handle)
   {
-	  // clear global response buffer
-	  struct write_result changes_result;
+	  string changes_result;
 
-	  url << COUCH_HOST << dbName->c_str() << "/" << "_changes?since=" << since_seq_num << "&include_docs=true";
-	  const std::string& tmp = url.str();
-	  const char* url_string = tmp.c_str();
+	  url << dbName->c_str() << "/" << "_changes?since=" << since_seq_num << "&include_docs=true";
 
-	  //curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, errorBuffer);
-	  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_write);
-	  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &changes_result);
-	  curl_easy_setopt(curl_handle, CURLOPT_URL, url_string);
-	  res = curl_easy_perform(curl_handle);
+	  // replicas only when they share the primary's sequence numbers
+	  uint64_t fetchStart = now_micros();
+	  res = couch_request(curl_handle, url.str(), changes_result, changesRoute);
+	  stats.record("changes_fetch", now_micros() - fetchStart);
 
 	  // parse the incoming JSON
-	  istringstream resultstream(changes_result.buffer);
+	  istringstream resultstream(changes_result);
 
 	  Json::Value root;
 	  Json::Reader rdr;
@@ -429,189 +904,631 @@ long CouchLuceneUpdater::addChanges(const char* target, const char* since_seq_nu
 
 	  if (parsingSuccessful)
 	  {
-		
-		// query by doc id
-		QueryParser* qp = _CLNEW QueryParser(WID_FIELD.c_str(), &an);
-		
-		const Json::Value arrayChanges = root["results"];
+		const Json::Value& arrayChanges = root["results"];
+
+		ChangeBatch batch;
+		begin_changes(target, dbName, batch);
 
 		// iterate over changes
-		for ( int index = 0; index < arrayChanges.size(); ++index )  
-		{
-			const Json::Value& objChange = arrayChanges[index];
+		for ( Json::Value::UInt index = 0; index < arrayChanges.size(); ++index )
+			add_change(batch, arrayChanges[index], dbName);
 
-			// get the sequence number for each document
-			// get the id for each doc
-			const string& id = objChange["id"].asString();
+		end_changes(batch);
 
-			// get the doc
-			Json::Value jsonDoc = objChange["doc"];
-			// write json doc to string
-			Json::FastWriter wrtr;
-			string docStr = wrtr.write(jsonDoc);
+		// get the last seq num
+		last_seq_num = (long) root["last_seq"].asUInt();
+	  }
+	  else
+	  {
+		write_error(rdr.getFormatedErrorMessages(), 400);
+	  }
 
-			// don't index design documents
-			if (id.find("_design") == string::npos)
-			{
-				wostringstream wStr;
-				wStr << id.c_str();
-				const wstring wtmp = wStr.str();
+	  curl_easy_cleanup(curl_handle);
+  }
 
-				// you can write (at the moment) a design document with a null id
-				if (wtmp.length() > 0)
-				{
-				
-					const TCHAR* wId_string = wtmp.c_str();
+  return last_seq_num;
+}
 
-					// read the current seq_num
-					reader = IndexReader::open(target);
-					IndexSearcher searcher(reader);
+// everything in the batch is allocated once and reused for each change:
+// one writer applies all deletes and additions, one document is cleared
+// between changes and the conversion buffers keep their capacity
+void CouchLuceneUpdater::begin_changes(const char* target, const string* dbName, ChangeBatch& batch)
+{
+	batch.writer = _CLNEW IndexWriter(target, &batch.an, false);
 
-					Query* q = qp->parse(wId_string);
-					Hits* h = searcher.search(q);
+	// get the index functions and names for this db
+	// dbName, (designId, (term, field flags))
+	// design docs in this batch update the map in place
+	batch.fields = &ftiMap[*dbName];
+}
 
-					if (h->length() > 0)
-					{
-						// remove existing document
-						Document doc = h->doc(0);
-						Term* t1 = _CLNEW Term(WID_FIELD.c_str(), wId_string);
-						reader->deleteDocuments(t1);
-						reader->flush();
-						_CLDECDELETE(t1);
-					}
+// swaps the seq config doc inside the batch, so it is committed with the changes up to new_seq
+void CouchLuceneUpdater::replace_seq_doc(ChangeBatch& batch, long old_seq, long new_seq)
+{
+	wstring wseq;
+
+	seq_term(old_seq, wseq);
+	Term* old = _CLNEW Term(WSEQ_NUM_FIELD.c_str(), wseq.c_str());
+	batch.writer->deleteDocuments(old);
+	_CLDECDELETE(old);
+
+	seq_term(new_seq, wseq);
+	Document config;
+	config.add(*_CLNEW Field(WSEQ_NUM_FIELD.c_str(), wseq.c_str(), Field::STORE_YES | Field::INDEX_UNTOKENIZED));
+	batch.writer->addDocument(&config);
+}
+
+void CouchLuceneUpdater::end_changes(ChangeBatch& batch)
+{
+	batch.doc.clear();
+
+	{
+		// closing the writer flushes the batch's segments and commits them
+		StatsTimer timer(stats, "commit");
+		batch.writer->close();
+		_CLDELETE(batch.writer);
+	}
+
+	stats.increment("batches");
+}
+
+// objChange is a _changes row, or an _all_docs row with include_docs=true
+void CouchLuceneUpdater::add_change(ChangeBatch& batch, const Json::Value& objChange, const string* dbName)
+{
+	const map<string, map <string, FieldDef > >& queryMap = *batch.fields;
+	Document& newdoc = batch.doc;
+
+	// get the id for each doc
+	const string id = objChange["id"].asString();
+
+	// get the doc
+	const Json::Value& jsonDoc = objChange["doc"];
+
+	// don't index design documents
+	if (id.find("_design") == string::npos)
+	{
+		utf8_to_tchar(id, batch.wId);
+
+		// you can write (at the moment) a design document with a null id
+		if (batch.wId.length() > 0)
+		{
+			Term* idTerm = _CLNEW Term(WID_FIELD.c_str(), batch.wId.c_str());
+
+			// if objChanges is not marked as deleted then it add it back
+			// (_all_docs marks it in the row's value)
+			bool deleted = objChange.get("deleted", false).asBool() || objChange["value"].get("deleted", false).asBool();
+
+			if (deleted == false)
+			{
+				// not marked as deleted
+				// so add the document back
+				newdoc.clear();
+				newdoc.add(*_CLNEW Field(WID_FIELD.c_str(), batch.wId.c_str(),
+					Field::STORE_YES));
+
+				jsval docval;
+				jsval jsresult;
+				JSBool ok = JS_FALSE;
+
+				// a doc missing the members every function requires is not evaluated at all
+				bool eligible = queryMap.empty();
+				for (map<string, map <string, FieldDef > >::const_iterator i = queryMap.begin(); !eligible && i != queryMap.end(); i++)
+				{
+					for (map<string, FieldDef>::const_iterator iFti = i->second.begin(); !eligible && iFti != i->second.end(); iFti++)
+						eligible = has_members(jsonDoc, iFti->second.required);
+				}
+
+				if (!eligible)
+				{
+					// it may have had fields before this change
+					batch.writer->deleteDocuments(idTerm);
+					stats.increment("docs_filtered");
+					_CLDECDELETE(idTerm);
+					return;
+				}
+
+				uint64_t evalStart = now_micros();
+
+				if (!queryMap.empty())
+				{
+					// put the current doc in scope once, every index function is called with it
+					batch.script.assign("var doc = ");
+					batch.script += batch.json.write(jsonDoc);
+					batch.script += ";";
 
-					searcher.close();
-					reader->close();
+					// the doc is utf-8 JSON, evaluate it as utf-16 so non-ascii content survives
+					utf8_to_utf16(batch.script.data(), batch.script.length(), batch.jsSource);
 
-					_CLDELETE(reader);
-					_CLDELETE(h);
-					_CLDELETE(q);
-					
-					// if objChanges is not marked as deleted then it add it back
-					Json::Value deletedValue;
-					deletedValue = objChange.get("deleted", false);
+					ok = JS_EvaluateUCScript(cx, global, (const jschar*) &batch.jsSource[0], (uintN) batch.jsSource.size(),
+										NULL, 0, &jsresult);
 
-					if (deletedValue.asBool() == false)
+					if (ok)
+						ok = JS_GetProperty(cx, global, "doc", &docval);
+				}
+
+				for (map<string, map <string, FieldDef > >::const_iterator i = queryMap.begin(); ok && i != queryMap.end(); i++)
+				{
+					// i->first; designId
+					// i->second; term, field definition
+					const map<string, FieldDef>& termMap = i->second;
+
+					for (map<string, FieldDef>::const_iterator iFti = termMap.begin(); iFti != termMap.end();  iFti++)
 					{
-						// not marked as deleted
-						// so add the document back	
-						Document newdoc;
-						wostringstream widstream;
-						widstream << id.c_str();
-						const wstring wid = widstream.str();
-
-						newdoc.add(*_CLNEW Field(WID_FIELD.c_str(), wId_string, 
-							Field::STORE_YES));
-						
-						// get the index functions and names for this db
-						// dbName, (designId, (term, {defaults, script}))
-						// map<string, map <string, FtiDefn > >  , designId, (term, defaults)
-						map<string, map <string, string > > queryMap = ftiMap[*dbName];
-
-						for (map<string, map <string, string > >::iterator i = queryMap.begin(); i != queryMap.end(); i++)
+						const string& term = iFti->first;
+
+						if (!has_members(jsonDoc, iFti->second.required))
+							continue;
+
+						// term is the prototype so we can call the function directly
+						if (JS_CallFunctionName(cx, global, term.c_str(), 1, &docval, &jsresult))
 						{
-							// i->first; designId
-							// i->second; term, defaults
-							map<string, string> termMap = i->second;
-
-							for (map<string, string>::iterator iFti = termMap.begin(); iFti != termMap.end();  iFti++)
-							{	
-								jsval jsresult;
-								char *filename = NULL;
-								uintN lineno = 0;
-								JSBool ok;
-					
-								string term = iFti->first;
-								string defaults = termMap[term];
-
-								// put the current doc in scope
-								ostringstream js;
-								js << "var doc = ";
-								js << docStr << ";" << endl;
-								
-								// term is the prototype so we can the function
-								js << term.c_str() << "(doc);" << endl;
-
-								const std::string tmp = js.str();
-								const char* js_str = tmp.c_str();
-								
-								ok = JS_EvaluateScript(cx, global, js_str, strlen(js_str),
-													filename, lineno, &jsresult);
-
-								if (ok)
+							// result is either a JSON structure
+							// {"value": _, "type": _, "field": _}
+							// just a string
+							JSString* str;
+
+							if (JSVAL_IS_OBJECT(jsresult) && !JSVAL_IS_NULL(jsresult))
+							{
+								jsval val;
+								JSObject* obj = (JSObject*)jsresult;
+								JS_GetProperty(cx, obj, "value", &val);
+								str = JS_ValueToString(cx, val);
+							}
+							else
+							{
+								str = JS_ValueToString(cx, jsresult);
+							}
+
+							// js strings are utf-16
+							utf16_to_tchar((const unsigned short*) JS_GetStringChars(str), JS_GetStringLength(str), batch.wValue);
+
+							if (batch.wValue.compare(L"undefined") != 0)
+							{
+								utf8_to_tchar(term, batch.wTerm);
+
+								// add term and value to lucene index
+								newdoc.add(*_CLNEW Field(batch.wTerm.c_str(), batch.wValue.c_str(), iFti->second.flags));
+
+								// prefix queries on this term become a single lookup in the n-gram field
+								if (iFti->second.edge_ngrams > 0)
 								{
-									// result is either a JSON structure
-									// {"value": _, "type": _, "field": _}
-									// just a string
-									wostringstream wv;
-
-									if (JSVAL_IS_OBJECT(jsresult) && !JSVAL_IS_NULL(jsresult))
-									{
-										jsval val;
-										JSObject* obj = (JSObject*)jsresult;
-										JS_GetProperty(cx, obj, "value", &val);
-										wv << JS_GetStringBytes(JS_ValueToString(cx, val));
-									}
-									else
-									{
-										wv << JS_GetStringBytes(JS_ValueToString(cx, jsresult));
-									}
-
-									const std::wstring& wtmp = wv.str();
-
-									if (wtmp.compare(L"undefined") != 0)
-									{
-										const TCHAR* wval = wtmp.c_str();
-
-										wostringstream wTermStream;
-										wTermStream << term.c_str();
-										const std::wstring& wTerm = wTermStream.str();
-
-										// add term and value to lucene index
-										newdoc.add(*_CLNEW Field(wTerm.c_str(), wval, Field::STORE_YES | Field::INDEX_TOKENIZED));							
-									}
+									edge_ngrams(batch.wValue, (size_t) iFti->second.edge_ngrams, batch.wNgrams);
+									batch.wTerm += WNGRAM_SUFFIX;
+									newdoc.add(*_CLNEW Field(batch.wTerm.c_str(), batch.wNgrams.c_str(), Field::STORE_NO | Field::INDEX_TOKENIZED));
 								}
 							}
 						}
-						
-						JS_MaybeGC(cx);
-
-						write_doc(target, &newdoc, &an, false);
 					}
 				}
+
+				maybe_gc(batch.script.length());
+				stats.record("js_eval", now_micros() - evalStart);
+
+				// replaces any existing document with this id
+				batch.writer->updateDocument(idTerm, &newdoc);
+				stats.increment("docs_indexed");
 			}
 			else
 			{
-				// we have a design document, parse for FTI functions
-				Json::Value jsonDoc = objChange["doc"];
-				Json::Value fti;
-				fti = jsonDoc.get("fulltext", 0u);
+				// remove existing document
+				batch.writer->deleteDocuments(idTerm);
+				stats.increment("docs_deleted");
+			}
 
-				if (fti.size() > 0)
-				{
-					Json::Value ftiObject = jsonDoc["fulltext"];
-					parseFTI(dbName, &id, ftiObject);
-				}
+			_CLDECDELETE(idTerm);
+		}
+	}
+	else
+	{
+		// we have a design document, parse for FTI functions
+		parse_design(dbName, &id, jsonDoc);
+	}
+}
 
-			}
+// seq is a number, or in later CouchDB versions a string starting with one
+static long seq_number(const Json::Value& seq)
+{
+	if (seq.isString())
+		return atol(seq.asCString());
+	if (seq.isNumeric())
+		return (long) seq.asUInt();
+	return 0;
+}
+
+long CouchLuceneUpdater::import_changes(const string& db, istream& changes, long seq)
+{
+	const std::string tmp = index_path(db);
+	const char* target = tmp.c_str();
 
-		} // end for loop
+	// rows already indexed are skipped, so an interrupted import can be rerun; the seq
+	// config doc stays until it is replaced in the commit of the imported rows
+	long indexed_seq = atol(read_seq_num(target, false).c_str());
+	long last_seq_num = indexed_seq;
 
+	// without --design the definitions cached with the index apply, e.g. one imported earlier
+	if (!designCache.isMember(db))
+		load_cached_design(db);
 
-		_CLLDELETE(qp);
+	ChangeBatch batch;
+	begin_changes(target, &db, batch);
 
-		// get the last seq num
-		last_seq_num = (long) root["last_seq"].asUInt();
-	  }
-	  else
-	  {
-		write_error(rdr.getFormatedErrorMessages(), 400);
-	  }
+	Json::Reader rdr;
+	Json::Value row;
+	string line;
 
-	  curl_easy_cleanup(curl_handle);
-  }
+	// CouchDB writes one row per line inside the results or rows array, so rows
+	// are parsed as they are read; a dump on a single line is parsed whole
+	while (getline(changes, line))
+	{
+		size_t end = line.find_last_not_of(" \t\r\n,");
+		if (end == string::npos)
+			continue;
+		line.erase(end + 1);
 
-  return last_seq_num;
+		if (line.compare(0, 11, "\"last_seq\":") == 0)
+		{
+			size_t value = line.find_first_not_of(" \"", 11);
+			long last = (value != string::npos) ? atol(line.c_str() + value) : 0;
+			if (last > last_seq_num)
+				last_seq_num = last;
+			continue;
+		}
+
+		// the opening {"results":[ or {"total_rows":...,"rows":[ and the closing ] don't parse
+		if (line[0] != '{' || !rdr.parse(line, row, false) || !row.isObject())
+			continue;
+
+		const Json::Value& parsed = row;
+		const Json::Value& rows = parsed.isMember("results") ? parsed["results"] : parsed["rows"];
+		Json::Value::UInt count = parsed.isMember("id") ? 1 : rows.size();
+
+		for (Json::Value::UInt r = 0; r < count; r++)
+		{
+			const Json::Value& change = parsed.isMember("id") ? parsed : rows[r];
+
+			long change_seq = seq_number(change["seq"]);
+			if (change_seq > 0 && change_seq <= indexed_seq)
+				continue;
+
+			if (change.isMember("id") && (change.isMember("doc") || change.isMember("deleted")))
+				add_change(batch, change, &db);
+
+			if (change_seq > last_seq_num)
+				last_seq_num = change_seq;
+		}
+
+		long last = seq_number(parsed["last_seq"]);
+		if (last > last_seq_num)
+			last_seq_num = last;
+	}
+
+	// _all_docs rows carry no seq, the caller passes the db's update_seq at the time of the dump
+	if (seq > 0)
+		last_seq_num = seq;
+
+	replace_seq_doc(batch, indexed_seq, last_seq_num);
+	end_changes(batch);
+
+	stats.set("last_seq." + db, last_seq_num);
+	save_stats();
+
+	// the definitions travel with the index, so update and daemon runs on a copy of it
+	// start from them rather than loading them from CouchDB
+	save_design_cache();
+
+	return last_seq_num;
+}
+
+// a design doc, or _all_docs output over the design doc range with include_docs=true
+bool CouchLuceneUpdater::import_design(const string& db, istream& design)
+{
+	Json::Value root;
+	Json::Reader reader;
+
+	if (!reader.parse(design, root))
+	{
+		write_error(reader.getFormatedErrorMessages(), 400);
+		return false;
+	}
+
+	if (root.isMember("rows"))
+	{
+		const Json::Value& rows = root["rows"];
+		for (Json::Value::UInt r = 0; r < rows.size(); r++)
+		{
+			const string designId = rows[r]["id"].asString();
+			parse_design(&db, &designId, rows[r]["doc"]);
+		}
+	}
+	else
+	{
+		const string designId = root["_id"].asString();
+		parse_design(&db, &designId, root);
+	}
+
+	return true;
+}
+
+// the _rev of each design doc in the db, false if CouchDB can't be asked
+bool CouchLuceneUpdater::get_design_revs(CURL* curl_handle, const string& db, map<string, string>& revs)
+{
+	ostringstream url;
+	string revs_result;
+	url << db.c_str() << "/_all_docs?startkey=%22_design%22&endkey=%22_design0%22";
+
+	if (couch_request(curl_handle, url.str(), revs_result, PRIMARY_FIRST) != CURLE_OK)
+		return false;
+
+	Json::Value root;
+	Json::Reader reader;
+	if (!reader.parse(revs_result, root) || !root["rows"].isArray())
+		return false;
+
+	const Json::Value& rows = root["rows"];
+	for (Json::Value::UInt r = 0; r < rows.size(); r++)
+		revs[rows[r]["id"].asString()] = rows[r]["value"]["rev"].asString();
+
+	return true;
+}
+
+// loads a db's definitions on first use: from the design cache when the revs of the db's
+// design docs still match it, otherwise from CouchDB; recheck revalidates a loaded db
+void CouchLuceneUpdater::ensure_design_docs(CURL* curl_handle, const string& db, bool recheck)
+{
+	bool loaded = loadedDbs.count(db) > 0;
+	if (loaded)
+		touch_db(db);
+	if (loaded && !recheck)
+		return;
+
+	CURL* handle = (curl_handle != NULL) ? curl_handle : curl_easy_init();
+	if (handle == NULL)
+		return;
+
+	map<string, string> revs;
+	bool asked = get_design_revs(handle, db, revs);
+
+	if (!designCache.isMember(db))
+		read_design_cache(db);
+
+	const Json::Value& cached = ((const Json::Value&) designCache)[db];
+	bool current = cached.isObject();
+
+	// CouchDB can't be reached: the cache is the best there is
+	if (asked)
+	{
+		current = current && cached.size() == revs.size();
+		for (map<string, string>::const_iterator itr = revs.begin(); current && itr != revs.end(); ++itr)
+			current = cached.isMember(itr->first) && cached[itr->first]["_rev"].asString().compare(itr->second) == 0;
+	}
+
+	if (current)
+	{
+		if (!loaded)
+		{
+			load_cached_design(db);
+			stats.increment("design_cache_hits");
+		}
+	}
+	else if (asked)
+	{
+		// definitions of design docs that changed or went away must not linger
+		unload_design_docs(db);
+		load_design_docs(handle, db);
+		stats.increment("design_cache_misses");
+	}
+
+	if (curl_handle == NULL)
+		curl_easy_cleanup(handle);
+}
+
+// compiles the definitions in a db's design cache entry, false if it has none
+bool CouchLuceneUpdater::load_cached_design(const string& db)
+{
+	if (!designCache.isMember(db))
+		read_design_cache(db);
+
+	const Json::Value& cached = ((const Json::Value&) designCache)[db];
+	if (!cached.isObject())
+		return false;
+
+	vector<string> designIds = cached.getMemberNames();
+	for (size_t d = 0; d < designIds.size(); d++)
+		parse_design(&db, &designIds[d], cached[designIds[d]]);
+
+	mark_loaded(db);
+	return true;
+}
+
+// moves a loaded db to the front of the LRU
+void CouchLuceneUpdater::touch_db(const string& db)
+{
+	map<string, LoadedDbList::iterator>::iterator loaded = loadedDbs.find(db);
+	if (loaded != loadedDbs.end())
+		loadedLru.splice(loadedLru.begin(), loadedLru, loaded->second);
+}
+
+// records a db's definitions as loaded, charged at the size of their JSON, and
+// evicts idle dbs if that takes the updater over --design_memory_bytes
+void CouchLuceneUpdater::mark_loaded(const string& db)
+{
+	Json::FastWriter writer;
+	size_t bytes = writer.write(((const Json::Value&) designCache)[db]).length();
+
+	map<string, LoadedDbList::iterator>::iterator loaded = loadedDbs.find(db);
+	if (loaded == loadedDbs.end())
+	{
+		loadedLru.push_front(LoadedDb());
+		loadedLru.front().db = db;
+		loadedLru.front().bytes = 0;
+		loaded = loadedDbs.insert(make_pair(db, loadedLru.begin())).first;
+	}
+	else
+		loadedLru.splice(loadedLru.begin(), loadedLru, loaded->second);
+
+	loadedBytes = loadedBytes - loaded->second->bytes + bytes;
+	loaded->second->bytes = bytes;
+
+	if (loadedBudget == 0 || loadedBytes <= loadedBudget)
+		return;
+
+	// least recently used first, skipping the db being loaded and any with changes waiting for a commit
+	LoadedDbList::iterator itr = loadedLru.end();
+	while (loadedBytes > loadedBudget && itr != loadedLru.begin())
+	{
+		--itr;
+
+		map<string, ChangesFeed*>::const_iterator feed = feeds.find(itr->db);
+		if (itr->db.compare(db) == 0 || (feed != feeds.end() && feed->second->batch != NULL))
+			continue;
+
+		const string evict = itr->db;
+		++itr;
+		unload_design_docs(evict);
+		evict_design_cache(evict);
+		stats.increment("dbs_evicted");
+	}
+
+	// the evicted functions are garbage now
+	JS_MaybeGC(cx);
+}
+
+// forgets a db's definitions and the JS functions compiled for them, ensure_design_docs
+// loads them again from the design cache
+void CouchLuceneUpdater::unload_design_docs(const string& db)
+{
+	map<string, map<string, map<string, FieldDef> > >::iterator defs = ftiMap.find(db);
+	if (defs != ftiMap.end())
+	{
+		// globals declared with var can't be deleted, clearing them lets the functions be collected
+		jsval cleared = JSVAL_VOID;
+		for (map<string, map<string, FieldDef> >::const_iterator i = defs->second.begin(); i != defs->second.end(); ++i)
+		{
+			for (map<string, FieldDef>::const_iterator iFti = i->second.begin(); iFti != i->second.end(); ++iFti)
+				JS_SetProperty(cx, global, iFti->first.c_str(), &cleared);
+		}
+
+		ftiMap.erase(defs);
+	}
+
+	map<string, LoadedDbList::iterator>::iterator loaded = loadedDbs.find(db);
+	if (loaded != loadedDbs.end())
+	{
+		loadedBytes -= loaded->second->bytes;
+		loadedLru.erase(loaded->second);
+		loadedDbs.erase(loaded);
+	}
+}
+
+// a db's definitions keyed on design doc id, with each design doc's _rev to revalidate
+// against; read from the db's folder the first time the db is used, so startup reads nothing
+void CouchLuceneUpdater::read_design_cache(const string& db)
+{
+	ifstream file(design_cache_path(db).c_str());
+	if (!file)
+		return;
+
+	Json::Value saved;
+	Json::Reader reader;
+	if (reader.parse(file, saved) && saved.isObject())
+		designCache[db].swap(saved);
+}
+
+// an evicted db's entry lives only in its file, so memory follows the budget;
+// an entry that can't be saved stays
+void CouchLuceneUpdater::evict_design_cache(const string& db)
+{
+	if (!designCache.isMember(db))
+		return;
+
+	if (dirtyDesigns.count(db) > 0)
+	{
+		if (!save_design_cache(db))
+			return;
+		dirtyDesigns.erase(db);
+	}
+
+	designCache.removeMember(db);
+}
+
+// writes the entries that changed since they were last saved, one file per db
+void CouchLuceneUpdater::save_design_cache()
+{
+	set<string>::iterator itr = dirtyDesigns.begin();
+	while (itr != dirtyDesigns.end())
+	{
+		if (save_design_cache(*itr))
+			dirtyDesigns.erase(itr++);
+		else
+			++itr;
+	}
+}
+
+bool CouchLuceneUpdater::save_design_cache(const string& db)
+{
+	Json::FastWriter writer;
+	const string json = writer.write(((const Json::Value&) designCache)[db]);
+
+	// the folder exists once the db is indexed, until then it holds only this file
+	MKDIR(index_path(db).c_str());
+
+	// written beside the index and renamed into place, like _stats.json
+	const string path = design_cache_path(db);
+	const string tmp = path + ".tmp";
+
+	FILE* file = fopen(tmp.c_str(), "wb");
+	if (file == NULL)
+		return false;
+
+	size_t written = fwrite(json.data(), 1, json.length(), file);
+	fclose(file);
+
+	if (written != json.length())
+		return false;
+
+#ifdef _MSC_VER
+	remove(path.c_str());
+#endif
+	return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+string CouchLuceneUpdater::design_cache_path(const string& db)
+{
+	return index_path(db) + "/_design.json";
+}
+
+// a design doc's fulltext definitions
+void CouchLuceneUpdater::parse_design(const string* dbName, const string* designId, const Json::Value& designDoc)
+{
+	// the parts of the doc the definitions come from are what the design cache keeps
+	Json::Value entry(Json::objectValue);
+	entry["_rev"] = designDoc["_rev"];
+	if (designDoc.isMember("fulltext"))
+		entry["fulltext"] = designDoc["fulltext"];
+
+	if (designDoc.get("_deleted", false).asBool())
+	{
+		// a deleted design doc's indexes are no longer updated
+		if (ftiMap.count(*dbName) > 0)
+			ftiMap[*dbName].erase(*designId);
+		if (designCache.isMember(*dbName))
+			designCache[*dbName].removeMember(*designId);
+		dirtyDesigns.insert(*dbName);
+	}
+	else if (((const Json::Value&) designCache)[*dbName][*designId] != entry)
+	{
+		designCache[*dbName][*designId] = entry;
+		dirtyDesigns.insert(*dbName);
+	}
+
+	Json::Value ftiObject = designDoc.get("fulltext", 0u);
+
+	if (ftiObject.size() > 0)
+		parseFTI(dbName, designId, ftiObject);
+
+	// a design doc arriving in the changes of a loaded db changes its size
+	if (loadedDbs.count(*dbName) > 0)
+		mark_loaded(*dbName);
 }
 
 void CouchLuceneUpdater::parseFTI(const string* dbName, const string* designDocName, Json::Value& ftiObject)
@@ -620,470 +1537,2074 @@ void CouchLuceneUpdater::parseFTI(const string* dbName, const string* designDocN
 	for (int idxFti = 0; idxFti < ftiObject.size(); ++idxFti ) 
 	{
 
-		string name = ftiObject.getMemberNames()[idxFti]; // this is part of the query term
+		string name = ftiObject.getMemberNames()[idxFti]; // this is part of the query term
+
+		// '#' marks the edge n-gram field of an index
+		if (name.find('#') != string::npos)
+		{
+			write_error("fulltext name can't contain '#': " + name, 500);
+			continue;
+		}
+
+		// remove _design prefix
+		string term = (*dbName + "_" + name);
+
+		Json::Value member = ftiObject[name];
+
+		int store = Field::STORE_YES;
+		int index = Field::INDEX_TOKENIZED;
+		int ngrams = 0;
+		JSScript* script = NULL;
+
+		// get the defaults and the script
+		Json::Value defaults;
+		defaults = member.get("defaults", 0u);
+		
+		if (defaults.size() > 0)
+		{
+			// "defaults": {"store": "yes", "index": "untokenized"}
+			// look for store
+			Json::Value storeValue;
+			storeValue = defaults.get("store", 0u);
+			if (storeValue.isString())
+			{
+				if (storeValue.asString().compare("no") == 0)
+					store = Field::STORE_NO;
+			}
+
+			// untokenized values are indexed as one term, which facet counts need
+			Json::Value indexValue;
+			indexValue = defaults.get("index", 0u);
+			if (indexValue.isString())
+			{
+				if (indexValue.asString().compare("untokenized") == 0)
+					index = Field::INDEX_UNTOKENIZED;
+			}
+
+			// "edge_ngrams": 10 indexes the first 1 to 10 characters of every token
+			Json::Value ngramValue;
+			ngramValue = defaults.get("edge_ngrams", 0u);
+			if (ngramValue.isNumeric())
+				ngrams = ngramValue.asInt();
+		}
+
+		// "requires": "tags" or ["type", "meta.title"], members the doc must have for the
+		// function to be called, checked without JS
+		vector< vector<string> > required;
+		Json::Value requiresValue = member.get("requires", 0u);
+		if (requiresValue.isString())
+		{
+			Json::Value paths(Json::arrayValue);
+			paths.append(requiresValue);
+			requiresValue = paths;
+		}
+
+		if (requiresValue.isArray())
+		{
+			for (Json::Value::UInt r = 0; r < requiresValue.size(); r++)
+			{
+				string path = requiresValue[r].asString();
+				vector<string> keys;
+				size_t start = 0;
+				size_t dot;
+
+				while ((dot = path.find('.', start)) != string::npos)
+				{
+					keys.push_back(path.substr(start, dot - start));
+					start = dot + 1;
+				}
+				keys.push_back(path.substr(start));
+
+				required.push_back(keys);
+			}
+		}
+
+
+	    // get index, the value is the fti script
+		Json::Value fulltext = 0u;
+		fulltext = member.get("index", 0u);
+
+		if (fulltext.isString())
+		{
+			string jsStr = fulltext.asString();
+			const char* js = jsStr.c_str();
+
+			jsval result;
+			char *filename = NULL;
+			uintN lineno = 0;
+
+			ostringstream js_stream;
+			// remove _design from ddoc
+			js_stream << "var " << term.c_str() << "=" << js << ";";
+			//js_stream << "var " << name.c_str() << "=" << js << ";";
+			const std::string& tmp = js_stream.str();
+			const char* js_string = tmp.c_str();
+			JSBool ok;
+
+			// function source may contain non-ascii literals, evaluate as utf-16
+			vector<unsigned short> jsSource;
+			utf8_to_utf16(tmp.data(), tmp.length(), jsSource);
+
+			ok = JS_EvaluateUCScript(cx, global, (const jschar*) &jsSource[0], (uintN) jsSource.size(),
+											filename, lineno, &result);
+			if (!ok)
+			{
+				write_error(js_string, 500);
+			}
+		}
+
+		// fti member map looks like  dbName, (designId, (term name, defaults)
+		FieldDef& def = ftiMap[*dbName][*designDocName][term.c_str()];
+		def.flags = store | index;
+		def.edge_ngrams = ngrams;
+		def.required = required;
+	}
+}
+
+void CouchLuceneUpdater::get_design_docs()
+{
+	CURL *curl_handle;
+	vector<string> dbs;
+
+	curl_handle = curl_easy_init();
+	if (curl_handle) 
+	{
+		if (get_all_dbs(curl_handle, dbs))
+		{
+			for (size_t index = 0; index < dbs.size(); ++index)
+				load_design_docs(curl_handle, dbs[index]);
+		}
+
+		curl_easy_cleanup(curl_handle);
+	}
+}
+
+// the list comes from the primary only, a replica may not hold every db and a missing
+// db has its index deleted
+bool CouchLuceneUpdater::get_all_dbs(CURL* curl_handle, vector<string>& dbs)
+{
+	string dbs_result;
+	if (couch_request(curl_handle, "_all_dbs", dbs_result, PRIMARY_ONLY) != CURLE_OK)
+	{
+		write_error("error getting _all_dbs", 500);
+		return false;
+	}
+
+	// parse the response
+	istringstream resultstream(dbs_result);
+
+	Json::Value root;
+	Json::Reader reader;
+	bool parsingSuccessful = reader.parse( resultstream, root );
+
+	if (!parsingSuccessful)
+	{
+		// parsing failed
+		write_error(reader.getFormatedErrorMessages(), 400);
+		return false;
+	}
+
+	// root is an array, an error such as {"error":"unauthorized"} is an object
+	if (!root.isArray())
+	{
+		write_error("_all_dbs is not an array", 500);
+		return false;
+	}
+
+	for (Json::Value::UInt index = 0; index < root.size(); ++index)
+	{
+		if (root[index].isString())
+			dbs.push_back(root[index].asString());
+	}
+
+	return true;
+}
+
+// true only when the primary answers 404 for the db, any other reply keeps its index
+bool CouchLuceneUpdater::db_missing(CURL* curl_handle, const string& db)
+{
+	string body;
+	if (couch_request(curl_handle, db, body, PRIMARY_ONLY) != CURLE_OK)
+		return false;
+
+	long status = 0;
+	curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &status);
+	return status == 404;
+}
+
+// get all design docs for the db and if they have an FTI component then add to the fti map
+void CouchLuceneUpdater::load_design_docs(CURL* curl_handle, const string& db)
+{
+	// e.g. http://localhost:5984/db/_all_docs?startkey=%22_design%22&endkey=%22_design0%22&include_docs=true
+	ostringstream url;
+	string design_result;
+	url << db.c_str() << "/_all_docs?startkey=%22_design%22&endkey=%22_design0%22&include_docs=true";
+
+	CURLcode res = couch_request(curl_handle, url.str(), design_result, PRIMARY_FIRST);
+
+	if (res == CURLE_OK)
+	{
+		Json::Value designRoot;
+		istringstream designstream(design_result);
+
+		Json::Reader reader;
+		bool designParsingSuccessful = reader.parse( designstream, designRoot );
+		if (designParsingSuccessful)
+		{
+			// a db without design docs is cached too, so it isn't fetched again
+			designCache[db] = Json::Value(Json::objectValue);
+			dirtyDesigns.insert(db);
+
+			const Json::Value rows = designRoot["rows"];
+			for (int rowIdx = 0; rowIdx < rows.size(); ++rowIdx)
+			{
+				// see if we have a full text field
+				const string designId = rows[rowIdx]["id"].asString();
+				parse_design(&db, &designId, rows[rowIdx]["doc"]);
+			}
+
+			mark_loaded(db);
+		}
+		else
+		{
+			// parsing failed
+			write_error(reader.getFormatedErrorMessages(), 400);
+		}
+	}
+	else
+	{
+		write_error("error getting design docs", 500);
+	}
+}
+
+/***************************************************
+*
+* Continuous _changes feeds (daemon mode)
+*
+*****************************************************/
+static size_t feed_write(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	ChangesFeed* feed = (ChangesFeed*) stream;
+	feed->lines.append((char*) ptr, size * nmemb);
+	return size * nmemb;
+}
+
+// --dbs=a,b              follow only these databases (default every db with fulltext definitions)
+// --commit_ms=N          commit a database's changes at least every N ms (default 1000)
+// --commit_docs=N        or after N changes (default 1000)
+// --heartbeat=N          _changes heartbeat in ms, a feed silent for 3 heartbeats reconnects (default 10000)
+// --db_refresh_ms=N      look for new and deleted databases every N ms (default 60000)
+// --design_recheck_ms=N  check a listed db without fulltext definitions for new ones every N ms (default 3600000)
+void CouchLuceneUpdater::follow_changes()
+{
+	set<string> only;
+	string dbs = get_option("dbs", "");
+	size_t start = 0;
+	while (start < dbs.length())
+	{
+		size_t comma = dbs.find(',', start);
+		if (comma == string::npos)
+			comma = dbs.length();
+
+		if (comma > start)
+			only.insert(dbs.substr(start, comma - start));
+		start = comma + 1;
+	}
+
+	uint64_t commitMicros = (uint64_t) get_long_option("commit_ms", 1000) * 1000;
+	long commitDocs = get_long_option("commit_docs", 1000);
+	long heartbeat = get_long_option("heartbeat", 10000);
+	uint64_t refreshMicros = (uint64_t) get_long_option("db_refresh_ms", 60000) * 1000;
+	uint64_t recheckMicros = (uint64_t) get_long_option("design_recheck_ms", 3600000) * 1000;
+
+	CURL* handle = curl_easy_init();
+	CURLM* multi = curl_multi_init();
+	uint64_t lastRefresh = 0;
+	bool refreshed = false;
+
+	while (true)
+	{
+		uint64_t now = now_micros();
+		if (!refreshed || now - lastRefresh >= refreshMicros)
+		{
+			// a failed refresh is tried again at the next one
+			try {
+				refresh_feeds(handle, multi, only, heartbeat, recheckMicros);
+			} catch (CLuceneError &e) {
+				write_error(e.what(), 500);
+			} catch (Json::Exception &e) {
+				write_error(e.what(), 500);
+			}
+
+			save_stats();
+			save_design_cache();
+			lastRefresh = now;
+			refreshed = true;
+		}
+
+		int running = 0;
+		curl_multi_perform(multi, &running);
+
+		// a feed that ends, e.g. when CouchDB restarts, reconnects from its last seq a second later
+		CURLMsg* msg;
+		int queued;
+		while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+		{
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			char* priv = NULL;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+			ChangesFeed* feed = (ChangesFeed*) priv;
+
+			try {
+				read_feed(feed);
+			} catch (CLuceneError &e) {
+				reset_feed(multi, feed, e.what());
+			} catch (Json::Exception &e) {
+				reset_feed(multi, feed, e.what());
+			}
+
+			disconnect_feed(multi, feed);
+			feed->retry_at = now + 1000000;
+			stats.increment("feed_disconnects");
+		}
+
+		now = now_micros();
+		bool committed = false;
+
+		for (map<string, ChangesFeed*>::iterator itr = feeds.begin(); itr != feeds.end(); ++itr)
+		{
+			ChangesFeed* feed = itr->second;
+
+			try {
+				read_feed(feed);
+
+				if (feed->batch != NULL && (feed->pending >= commitDocs || now - feed->batch_start >= commitMicros))
+				{
+					commit_feed(feed);
+					committed = true;
+				}
+			} catch (CLuceneError &e) {
+				reset_feed(multi, feed, e.what());
+			} catch (Json::Exception &e) {
+				reset_feed(multi, feed, e.what());
+			}
+
+			if (feed->handle == NULL && now >= feed->retry_at)
+				connect_feed(multi, feed, heartbeat);
+		}
+
+		if (committed)
+		{
+			save_stats();
+			save_design_cache();
+		}
+
+		// curl_multi_wait returns at once when there is nothing to wait on
+		int ready = 0;
+		curl_multi_wait(multi, NULL, 0, 100, &ready);
+		if (running == 0)
+			_LUCENE_SLEEP(100);
+	}
+}
+
+// starts feeds for new databases with fulltext definitions, and stops those whose database was deleted
+void CouchLuceneUpdater::refresh_feeds(CURL* handle, CURLM* multi, const set<string>& only, long heartbeat, uint64_t recheckMicros)
+{
+	vector<string> dbs;
+	if (!get_all_dbs(handle, dbs))
+		return;
+
+	set<string> listed;
+	for (size_t i = 0; i < dbs.size(); i++)
+	{
+		const string& db = dbs[i];
+		if (!only.empty() && only.count(db) == 0)
+			continue;
+
+		listed.insert(db);
+		if (feeds.count(db) > 0)
+			continue;
+
+		// followed databases see their design docs in the feed; the rest are checked when first
+		// listed and then every --design_recheck_ms, a request per db at every refresh adds up
+		uint64_t now = now_micros();
+		map<string, uint64_t>::const_iterator checked = designChecks.find(db);
+		if (checked != designChecks.end() && now - checked->second < recheckMicros)
+			continue;
+
+		designChecks[db] = now;
+		ensure_design_docs(handle, db, true);
+
+		map<string, map<string, map<string, FieldDef> > >::const_iterator defs = ftiMap.find(db);
+		if (defs == ftiMap.end() || defs->second.empty())
+			continue;
+
+		const string target = index_path(db);
+
+		ChangesFeed* feed = new ChangesFeed();
+		feed->db = db;
+		feed->handle = NULL;
+		feed->batch = NULL;
+		feed->seq = atol(read_seq_num(target.c_str(), false).c_str());
+		feed->committed_seq = feed->seq;
+		feed->pending = 0;
+		feed->batch_start = 0;
+		feed->retry_at = 0;
+		feed->commits = 0;
+		feeds[db] = feed;
+
+		connect_feed(multi, feed, heartbeat);
+	}
+
+	map<string, uint64_t>::iterator check = designChecks.begin();
+	while (check != designChecks.end())
+	{
+		if (listed.count(check->first) == 0)
+			designChecks.erase(check++);
+		else
+			++check;
+	}
+
+	map<string, ChangesFeed*>::iterator itr = feeds.begin();
+	while (itr != feeds.end())
+	{
+		if (listed.count(itr->first) > 0 || !db_missing(handle, itr->first))
+		{
+			++itr;
+			continue;
+		}
+
+		// the db is gone, so are its changes waiting for a commit; aborting
+		// them keeps the writer from committing into the index being deleted
+		ChangesFeed* feed = itr->second;
+		disconnect_feed(multi, feed);
+		abort_batch(feed);
+
+		delete_index(feed->db);
+		delete feed;
+		feeds.erase(itr++);
+	}
+}
+
+void CouchLuceneUpdater::connect_feed(CURLM* multi, ChangesFeed* feed, long heartbeat)
+{
+	ostringstream url;
+	url << couchHost << feed->db << "/_changes?feed=continuous&include_docs=true&heartbeat=" << heartbeat
+		<< "&since=" << feed->seq;
+
+	feed->lines.erase();
+	feed->handle = curl_easy_init();
+	prepare_handle(feed->handle, false);
+
+	curl_easy_setopt(feed->handle, CURLOPT_URL, url.str().c_str());
+	curl_easy_setopt(feed->handle, CURLOPT_WRITEFUNCTION, feed_write);
+	curl_easy_setopt(feed->handle, CURLOPT_WRITEDATA, feed);
+	curl_easy_setopt(feed->handle, CURLOPT_PRIVATE, feed);
+
+	// a feed that misses a few heartbeats is dead
+	curl_easy_setopt(feed->handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(feed->handle, CURLOPT_LOW_SPEED_TIME, (long) (heartbeat * 3 / 1000 + 1));
+
+	curl_multi_add_handle(multi, feed->handle);
+	stats.increment("feed_connects");
+}
+
+void CouchLuceneUpdater::disconnect_feed(CURLM* multi, ChangesFeed* feed)
+{
+	if (feed->handle == NULL)
+		return;
+
+	curl_multi_remove_handle(multi, feed->handle);
+	curl_easy_cleanup(feed->handle);
+	feed->handle = NULL;
+
+	// a partial last line is read again after reconnecting
+	feed->lines.erase();
+}
+
+// indexes the complete lines received so far into the feed's open batch
+void CouchLuceneUpdater::read_feed(ChangesFeed* feed)
+{
+	Json::Reader reader;
+	Json::Value change;
+	size_t start = 0;
+	size_t end;
+
+	while ((end = feed->lines.find('\n', start)) != string::npos)
+	{
+		const string line = feed->lines.substr(start, end - start);
+		start = end + 1;
+
+		// heartbeats are empty lines, errors and the closing {"last_seq": N} have no id
+		if (line.find_first_not_of(" \r") == string::npos || !reader.parse(line, change, false) || !change.isMember("id"))
+			continue;
+
+		if (feed->batch == NULL)
+		{
+			const string target = index_path(feed->db);
+
+			// reloads the db's definitions if they were evicted while it was idle
+			ensure_design_docs(NULL, feed->db, false);
+
+			feed->batch = new ChangeBatch();
+			feed->batch->writer = NULL;
+			begin_changes(target.c_str(), &feed->db, *feed->batch);
+			feed->batch_start = now_micros();
+		}
+
+		add_change(*feed->batch, change, &feed->db);
+		feed->pending++;
+		feed->seq = seq_number(change["seq"]);
+	}
+
+	feed->lines.erase(0, start);
+}
+
+// a feed whose changes can't be indexed, e.g. while another writer holds the index's
+// write.lock, drops its uncommitted batch and reads the changes again from its last commit
+void CouchLuceneUpdater::reset_feed(CURLM* multi, ChangesFeed* feed, const string& error)
+{
+	write_error(feed->db + ": " + error, 500);
+	stats.increment("feed_errors");
+
+	abort_batch(feed);
+	disconnect_feed(multi, feed);
+	feed->seq = feed->committed_seq;
+	feed->retry_at = now_micros() + 1000000;
+}
+
+// discards the feed's open batch without committing any of it
+void CouchLuceneUpdater::abort_batch(ChangesFeed* feed)
+{
+	if (feed->batch == NULL)
+		return;
+
+	if (feed->batch->writer != NULL)
+	{
+		try {
+			feed->batch->writer->abort();
+		} catch (CLuceneError &e) {
+			// a writer that failed mid-commit may not abort cleanly, it is deleted regardless
+		}
+		_CLDELETE(feed->batch->writer);
+	}
+
+	delete feed->batch;
+	feed->batch = NULL;
+	feed->pending = 0;
+}
+
+// the seq config doc is replaced in the same commit as the changes it covers,
+// so a crash at any point restarts the feed from changes that are in the index
+void CouchLuceneUpdater::commit_feed(ChangesFeed* feed)
+{
+	ChangeBatch& batch = *feed->batch;
+
+	replace_seq_doc(batch, feed->committed_seq, feed->seq);
+	end_changes(batch);
+	delete feed->batch;
+	feed->batch = NULL;
+	feed->pending = 0;
+	feed->committed_seq = feed->seq;
+	stats.set("last_seq." + feed->db, feed->seq);
+
+	if (optimize_count > 0 && ++feed->commits >= optimize_count)
+	{
+		optimize(feed->db);
+		feed->commits = 0;
+	}
+}
+
+/***************************************************
+*
+* CouchLuceneQuery
+*
+*****************************************************/
+// filter over bitsets owned by the query cache, or an intersection of them it owns itself
+class BitSetFilter : public Filter {
+private:
+	BitSet* bitset;
+	bool owned;
+public:
+	BitSetFilter(BitSet* bits, bool ownBits)
+	{
+		bitset = bits;
+		owned = ownBits;
+	}
+	~BitSetFilter()
+	{
+		if (owned)
+			_CLDELETE(bitset);
+	}
+	Filter* clone() const
+	{
+		return _CLNEW BitSetFilter(owned ? bitset->clone() : bitset, owned);
+	}
+	BitSet* bits(IndexReader* reader)
+	{
+		return bitset;
+	}
+	bool shouldDeleteBitSet(const BitSet* bs) const
+	{
+		return false;
+	}
+	TCHAR* toString()
+	{
+		return STRDUP_TtoT(_T("BitSetFilter"));
+	}
+};
+
+CouchLuceneQuery::CouchLuceneQuery(string* dir, const Options &opts)
+{
+	indexDir = dir;
+	options = opts;
+	read_couch_host();
+
+	// --mmap=true reads index files through memory mapped views rather than buffered file reads
+	useMMap = get_bool_option("mmap", false);
+
+	// --filter_cache_size is the number of fq clause results kept per open index
+	filterCacheSize = (size_t) get_long_option("filter_cache_size", 64);
+
+	// prefix and wildcard guardrails, see GuardedQueryParser
+	queryLimits.minPrefixLength = (size_t) get_long_option("min_prefix_length", 2);
+	queryLimits.constantScoreTerms = (size_t) get_long_option("constant_score_terms", 512);
+	queryLimits.maxExpandedTerms = (size_t) get_long_option("max_expanded_terms", 10000);
+
+	// --query_timeout is the default time budget in milliseconds for a search, 0 for none
+	queryTimeout = (int) get_long_option("query_timeout", 0);
+
+	// POST batches run up to --batch_threads searches at once, --batch_max_queries per request
+	batchThreads = get_long_option("batch_threads", 4);
+	batchMaxQueries = get_long_option("batch_max_queries", 100);
+
+	// --query_cache_bytes bounds the memory used by cached query results, 0 disables the cache
+	queryCache.set_budget((size_t) get_long_option("query_cache_bytes", 16L * 1024L * 1024L));
+
+	// curl's global state must be set up before several threads create handles
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	// --query_threads handles that many requests at once, 1 answers each request before reading the next
+	queryThreads = get_long_option("query_threads", 1);
+	shuttingDown = false;
+	nextSeq = 0;
+	nextOutput = 0;
+
+	for (long t = 0; queryThreads > 1 && t < queryThreads; t++)
+		workers.push_back(_LUCENE_THREAD_CREATE(&query_worker, this));
+}
+
+CouchLuceneQuery::~CouchLuceneQuery()
+{
+	{
+		// workers finish the queued requests before they exit
+		SCOPED_LOCK_MUTEX(queueLock);
+		shuttingDown = true;
+		CONDITION_NOTIFYALL(queueCondition);
+	}
+
+	for (size_t t = 0; t < workers.size(); t++)
+		_LUCENE_THREAD_JOIN(workers[t]);
+
+	for (map<string, CachedIndex*>::iterator itr = indexCache.begin(); itr != indexCache.end(); ++itr)
+		close_index(itr->second);
+
+	indexCache.clear();
+}
+
+void CouchLuceneQuery::close_index(CachedIndex* index)
+{
+	for (map<string, BitSet*>::iterator itr = index->filters.begin(); itr != index->filters.end(); ++itr)
+		_CLDELETE(itr->second);
+
+	for (map<string, FacetField*>::iterator itr = index->facets.begin(); itr != index->facets.end(); ++itr)
+		delete itr->second;
+
+	index->searcher->close();
+	_CLDELETE(index->searcher);
+
+	index->reader->close();
+	_CLDELETE(index->reader);
+
+	delete index;
+}
+
+CouchLuceneQuery::CachedIndex* CouchLuceneQuery::get_index(const string &db)
+{
+	// every caller must hand the index back with release_index
+	const string target = index_path(db);
+
+	SCOPED_LOCK_MUTEX(indexLock);
+
+	map<string, CachedIndex*>::iterator itr = indexCache.find(db);
+	if (itr != indexCache.end())
+	{
+		CachedIndex* index = itr->second;
+
+		// reuse the open reader until the updater commits a new version of the index
+		if (IndexReader::indexExists(target.c_str()) && index->reader->isCurrent())
+		{
+			index->refs++;
+			return index;
+		}
+
+		// requests still searching the old reader close it when they finish
+		indexCache.erase(itr);
+		index->stale = true;
+		if (index->refs == 0)
+			close_index(index);
+	}
+
+	FSDirectory* dir = FSDirectory::getDirectory(target.c_str());
+	dir->setUseMMap(useMMap);
+
+	// the reader takes ownership of the directory reference once it opens, a db that
+	// isn't indexed yet fails here on every query
+	IndexReader* reader;
+	try {
+		reader = IndexReader::open(dir, true);
+	} catch (CLuceneError &e) {
+		_CLDECDELETE(dir);
+		throw;
+	}
+
+	CachedIndex* index = new CachedIndex();
+	index->reader = reader;
+	index->searcher = _CLNEW IndexSearcher(index->reader);
+	index->refs = 1;
+	index->stale = false;
+
+	indexCache[db] = index;
+
+	return index;
+}
+
+void CouchLuceneQuery::release_index(CachedIndex* index)
+{
+	SCOPED_LOCK_MUTEX(indexLock);
+
+	if (--index->refs == 0 && index->stale)
+		close_index(index);
+}
+
+void CouchLuceneQuery::get_doc(const char* db, const char* id, string& result)
+{
+	CURL *curl_handle;
+	ostringstream url;
+
+	url << db << "/" << id;
+
+	curl_handle = curl_easy_init();
+	if (curl_handle) 
+	{
+		couch_request(curl_handle, url.str(), result, REPLICA_FIRST);
+		curl_easy_cleanup(curl_handle);
+	}
+}
+
+void CouchLuceneQuery::get_bulk_docs(const char* db, const char* json_request, string& result, CouchRoute route)
+{
+	CURL *curl_handle;
+	ostringstream url;
+
+	url << db << "/" << "_all_docs?include_docs=true";
+
+	curl_handle = curl_easy_init();
+	if (curl_handle) 
+	{
+		curl_easy_setopt(curl_handle, CURLOPT_POST, 1);
+		curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, json_request);
+
+		couch_request(curl_handle, url.str(), result, route);
+		curl_easy_cleanup(curl_handle);
+	}
+}
+
+void CouchLuceneQuery::handle_request(const string &request)
+{
+	if (workers.empty())
+	{
+		// the caller writes the error, a response cut short mustn't prefix it
+		try {
+			process_request(request, out);
+		} catch (CLuceneError &e) {
+			out.clear();
+			throw;
+		}
+		return;
+	}
+
+	// hand the request to the pool, waiting while the workers are a few requests behind
+	SCOPED_LOCK_MUTEX(queueLock);
+
+	while (requestQueue.size() >= workers.size() * 4)
+		CONDITION_WAIT(queueLock, queueCondition);
+
+	requestQueue.push_back(PendingRequest());
+	requestQueue.back().seq = nextSeq++;
+	requestQueue.back().request = request;
+
+	CONDITION_NOTIFYALL(queueCondition);
+}
+
+_LUCENE_THREAD_FUNC(CouchLuceneQuery::query_worker, arg)
+{
+	CouchLuceneQuery* query = (CouchLuceneQuery*) arg;
+
+	// each worker builds its responses in its own buffer
+	ResponseWriter writer(-1);
+	string lines;
+
+	while (true)
+	{
+		PendingRequest pending;
+		{
+			SCOPED_LOCK_MUTEX(query->queueLock);
+
+			while (query->requestQueue.empty() && !query->shuttingDown)
+				CONDITION_WAIT(query->queueLock, query->queueCondition);
+
+			if (query->requestQueue.empty())
+				break;
+
+			pending.seq = query->requestQueue.front().seq;
+			pending.request.swap(query->requestQueue.front().request);
+			query->requestQueue.pop_front();
+
+			CONDITION_NOTIFYALL(query->queueCondition);
+		}
+
+		try {
+			query->process_request(pending.request, writer);
+		} catch (CLuceneError &e) {
+			writer.clear();
+			query->write_error(writer, e.what(), 500);
+		} catch (std::exception &e) {
+			// anything escaping a worker thread would end the process, e.g. bad_alloc
+			// or jsoncpp's LogicError on a malformed request
+			writer.clear();
+			query->write_error(writer, e.what(), 500);
+		} catch (...) {
+			writer.clear();
+			query->write_error(writer, "unexpected error", 500);
+		}
+
+		writer.take_lines(lines);
+		query->complete_response(pending.seq, lines);
+	}
+
+	_LUCENE_THREAD_FUNC_RETURN(0);
+}
+
+void CouchLuceneQuery::complete_response(long seq, string &lines)
+{
+	// couchdb matches responses to requests by order, so hold back any that finish early
+	SCOPED_LOCK_MUTEX(outputLock);
+
+	readyResponses[seq].swap(lines);
+
+	map<long, string>::iterator itr;
+	while ((itr = readyResponses.find(nextOutput)) != readyResponses.end())
+	{
+		out.write_all(itr->second);
+		readyResponses.erase(itr);
+		nextOutput++;
+	}
+}
+
+void CouchLuceneQuery::process_request(const string &request, ResponseWriter &out)
+{
+/*
+	{
+		"info":{
+			"db_name":"test",
+			"doc_count":1,
+			"doc_del_count":1,
+			"update_seq":7,
+			"purge_seq":0,
+			"compact_running":false,
+			"disk_size":28761,
+			"instance_start_time":"1275666414427000",
+			"disk_format_version":5
+			},
+		"id":null,
+		"method":"GET",
+		"path":["test","_fti"],
+		"query":{"q":"request"},
+		"headers":{"Accept":"*\\/*",
+		"Host":"localhost:5984",
+		"User-Agent":"curl/7.17.1 (i586-pc-mingw32msvc) libcurl/7.17.1 OpenSSL/0.9.7e zlib/1.2.3"},
+		"body":"undefined",
+		"peer":"127.0.0.1",
+		"form":{},
+		"cookie":{},
+		"userCtx":{"db":"test","name":null,"roles":["_admin"]}}
+*/
+
+	StatsTimer timer(stats, "request");
+	stats.increment("requests");
+
+	// parse the incoming json
+	Json::Value root;
+	Json::Reader reader;
+	istringstream requeststream(request); 
+	bool parsingSuccessful = reader.parse( requeststream, root );
+
+	if (parsingSuccessful)
+	{
+
+		const Json::Value arrPath = root["path"];
+		string db = arrPath[0u].asString();
+
+		string ftiHandler = arrPath[1u].asString();
+
+		if (arrPath.size() > 2 && arrPath[2u].asString().compare("_stats") == 0)
+		{
+			// _stats is reserved, it can't be an index name
+			write_stats(db, root["info"], out);
+		}
+		else if (arrPath.size() > 2)
+		{
+			// term name is included
+			string term = arrPath[2u].asString();
+
+			// parse the query string
+			QuerySpec spec;
+			string error;
+
+			if (read_query_spec(db, term, root["query"], spec, error))
+			{
+				QueryResult result;
+				bool ok = true;
+
+				try {
+					run_query(spec, result);
+				} catch (CLuceneError &e) {
+					// a query the parser or the guardrails reject is the caller's mistake
+					if (e.number() != CL_ERR_Parse && e.number() != CL_ERR_TooManyClauses)
+						throw;
+
+					stats.increment("rejected_queries");
+					write_error(out, e.what(), 400);
+					ok = false;
+				}
+
+				if (ok)
+					write_results(out, spec, result);
+			}
+			else
+			{
+				write_error(out, error, 400);
+			}
+		}
+		else if (root["method"].asString().compare("POST") == 0)
+		{
+			// several queries in one request
+			handle_batch(db, root["body"], out);
+		}
+		else if (root["method"].asString().compare("GET") == 0)
+		{
+			// no index name, describe the db's index
+			write_info(db, root["info"], out);
+		}
+		else
+			write_error(out, "query term context required", 400);
+
+	}
+	else
+	{
+		write_error(out, reader.getFormatedErrorMessages(), 400);
+	}
+}
+
+BitSet* CouchLuceneQuery::get_filter(CachedIndex* index, const string &field, const string &clause)
+{
+	// the bitsets belong to the open reader and are dropped with it when the index changes,
+	// the caller holds index->filterLock while it uses the result
+	const string key = field + "\n" + clause;
+
+	map<string, BitSet*>::iterator itr = index->filters.find(key);
+	if (itr != index->filters.end())
+		return itr->second;
+
+	// a cached filter has to be complete, so it has no deadline
+	bool timedOut;
+	Query* query = parse_query(index, field, clause, 0, timedOut);
+	QueryFilter filter(query);
+	BitSet* bits = filter.bits(index->reader);
+	_CLDELETE(query);
+
+	if (index->filters.size() >= filterCacheSize && !index->filterOrder.empty())
+	{
+		// evict the oldest clause
+		map<string, BitSet*>::iterator oldest = index->filters.find(index->filterOrder.front());
+		_CLDELETE(oldest->second);
+		index->filters.erase(oldest);
+		index->filterOrder.pop_front();
+	}
+
+	index->filters[key] = bits;
+	index->filterOrder.push_back(key);
+
+	return bits;
+}
+
+FacetField::~FacetField()
+{
+	for (size_t i = 0; i < spareCounts.size(); i++)
+		delete spareCounts[i];
+}
+
+// the first search on a field allocates its counts, later ones reuse them
+vector<int32_t>* FacetField::take_counts()
+{
+	{
+		SCOPED_LOCK_MUTEX(spareLock);
+		if (!spareCounts.empty())
+		{
+			vector<int32_t>* counts = spareCounts.back();
+			spareCounts.pop_back();
+			return counts;
+		}
+	}
+
+	return new vector<int32_t>(terms.size(), 0);
+}
+
+void FacetField::return_counts(vector<int32_t>* counts, const vector<int32_t>& seen)
+{
+	for (size_t i = 0; i < seen.size(); i++)
+		(*counts)[seen[i]] = 0;
+
+	SCOPED_LOCK_MUTEX(spareLock);
+	spareCounts.push_back(counts);
+}
+
+void CouchLuceneQuery::get_facet_fields(CachedIndex* index, const QuerySpec &spec, vector<FacetField*> &fields)
+{
+	// term ordinals are read once per reader, the arrays live until the index changes
+	SCOPED_LOCK_MUTEX(index->filterLock);
+
+	fields.clear();
+
+	for (size_t i = 0; i < spec.facets.size(); i++)
+	{
+		const string field = spec.db + "_" + spec.facets[i];
+
+		map<string, FacetField*>::iterator itr = index->facets.find(field);
+		if (itr != index->facets.end())
+		{
+			fields.push_back(itr->second);
+			continue;
+		}
+
+		FacetField* facet = new FacetField();
+		facet->ords.assign(index->reader->maxDoc(), -1);
+
+		wstring wfield;
+		utf8_to_tchar(field, wfield);
+
+		// walk the field's terms in order, numbering them and marking their documents
+		Term* start = _CLNEW Term(wfield.c_str(), L"");
+		TermEnum* terms = index->reader->terms(start);
+		TermDocs* docs = index->reader->termDocs();
+
+		do {
+			Term* term = terms->term(false);
+			if (term == NULL || _tcscmp(term->field(), wfield.c_str()) != 0)
+				break;
+
+			int32_t ord = (int32_t) facet->terms.size();
+			facet->terms.push_back(term->text());
+
+			docs->seek(terms);
+			while (docs->next())
+			{
+				// an untokenized field has one term per document, keep the first if not
+				if (facet->ords[docs->doc()] < 0)
+					facet->ords[docs->doc()] = ord;
+			}
+		} while (terms->next());
+
+		docs->close();
+		_CLDELETE(docs);
+		terms->close();
+		_CLDELETE(terms);
+		_CLDECDELETE(start);
+
+		index->facets[field] = facet;
+		fields.push_back(facet);
+	}
+}
+
+bool CouchLuceneQuery::read_query_spec(const string &db, const string &term, const Json::Value &queryObject, QuerySpec &spec, string &error)
+{
+	// is there a query
+	const Json::Value& query = queryObject["q"];
+
+	if (!query.isString())
+	{
+		// no query object
+		error = "query parameter q required";
+		return false;
+	}
+
+	spec.db = db;
+	spec.field = db + "_" + term;
+	spec.q = query.asString();
+	spec.skip = query_int(queryObject["skip"], 0);
+	spec.limit = query_int(queryObject["limit"], 0);
+	spec.include_docs = query_bool(queryObject["include_docs"], false);
+
+	// fq is one filter clause, or a JSON array of clauses that must all match
+	query_strings(queryObject["fq"], spec.fq);
+
+	// facet names one or more untokenized indexes of this db to count terms of
+	query_strings(queryObject["facet"], spec.facets);
+	spec.facet_limit = query_int(queryObject["facet_limit"], 10);
+
+	// highlight returns marked fragments of the stored values of these indexes with each hit
+	query_strings(queryObject["highlight"], spec.highlights);
+	spec.highlight_size = query_int(queryObject["highlight_size"], 100);
+	spec.highlight_count = query_int(queryObject["highlight_count"], 3);
+
+	// timeout in milliseconds stops the search and returns the hits found so far
+	spec.timeout = query_int(queryObject["timeout"], queryTimeout);
+
+	if (spec.skip < 0 || spec.limit < 0 || spec.facet_limit < 0 || spec.highlight_size <= 0 || spec.highlight_count < 0 || spec.timeout < 0)
+	{
+		error = "skip, limit, facet_limit, highlight_count and timeout must not be negative, highlight_size must be positive";
+		return false;
+	}
+
+	for (size_t i = 0; i < spec.facets.size(); i++)
+	{
+		if (spec.facets[i].find_first_of("\n\t") != string::npos)
+		{
+			error = "invalid facet name";
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < spec.highlights.size(); i++)
+	{
+		if (spec.highlights[i].find_first_of("\n\t") != string::npos)
+		{
+			error = "invalid highlight name";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+Query* CouchLuceneQuery::parse_query(CachedIndex* index, const string &field, const string &q, uint64_t deadline, bool &timedOut)
+{
+	WhitespaceAnalyzer analyzer;
+
+	wstring wfld_string;
+	utf8_to_tchar(field, wfld_string);
+
+	wstring wquery_string;
+	utf8_to_tchar(q, wquery_string);
+
+	// prefix and wildcard terms are checked against the index before they expand
+	GuardedQueryParser parser(wfld_string.c_str(), &analyzer, index->reader, queryLimits, deadline);
+	Query* query = parser.parse(wquery_string.c_str());
+
+	timedOut = parser.timed_out();
+	return query;
+}
+
+Filter* CouchLuceneQuery::make_filter(CachedIndex* index, const QuerySpec &spec)
+{
+	// restrict to documents matching every cached filter clause
+	if (spec.fq.size() > 0)
+	{
+		// another request may evict the cached bitsets, so the filter gets its own copy
+		SCOPED_LOCK_MUTEX(index->filterLock);
+
+		BitSet* bits = get_filter(index, spec.field, spec.fq[0])->clone();
+
+		for (size_t i = 1; i < spec.fq.size(); i++)
+		{
+			BitSet* clause = get_filter(index, spec.field, spec.fq[i]);
+
+			for (int32_t doc = 0; doc < bits->size(); doc++)
+			{
+				if (bits->get(doc) && !clause->get(doc))
+					bits->set(doc, false);
+			}
+		}
+
+		return _CLNEW BitSetFilter(bits, true);
+	}
+
+	return NULL;
+}
+
+// orders hits by score, highest first, then by document number
+struct HitOrder {
+	bool operator()(const pair<float_t, int32_t>& a, const pair<float_t, int32_t>& b) const
+	{
+		return a.first > b.first || (a.first == b.first && a.second < b.second);
+	}
+};
+
+// keeps the top hits and counts facet terms in one pass over the matching documents,
+// facet counts only touch the terms that occur
+class PageCollector {
+private:
+	size_t wanted;                      // hits to keep, 0 for all
+	const vector<FacetField*>& fields;
+public:
+	vector< pair<float_t, int32_t> > top;  // score, doc; a heap with the worst hit first
+	int32_t total;
+	float_t maxScore;
+	vector< vector<int32_t>* > counts; // per facet field, per term ordinal; borrowed from the field
+	vector< vector<int32_t> > seen;    // per facet field, ordinals with a count
+
+	PageCollector(size_t wantedHits, const vector<FacetField*>& facetFields)
+		: wanted(wantedHits), fields(facetFields), total(0), maxScore(0)
+	{
+		counts.resize(fields.size());
+		seen.resize(fields.size());
+
+		for (size_t f = 0; f < fields.size(); f++)
+			counts[f] = fields[f]->take_counts();
+	}
+
+	~PageCollector()
+	{
+		for (size_t f = 0; f < fields.size(); f++)
+			fields[f]->return_counts(counts[f], seen[f]);
+	}
+
+	void collect(const int32_t doc, const float_t score)
+	{
+		total++;
+		if (score > maxScore)
+			maxScore = score;
+
+		pair<float_t, int32_t> hit(score, doc);
+
+		if (wanted == 0 || top.size() < wanted)
+		{
+			top.push_back(hit);
+			push_heap(top.begin(), top.end(), HitOrder());
+		}
+		else if (HitOrder()(hit, top.front()))
+		{
+			pop_heap(top.begin(), top.end(), HitOrder());
+			top.back() = hit;
+			push_heap(top.begin(), top.end(), HitOrder());
+		}
+
+		for (size_t f = 0; f < fields.size(); f++)
+		{
+			int32_t ord = fields[f]->ords[doc];
+			if (ord >= 0 && (*counts[f])[ord]++ == 0)
+				seen[f].push_back(ord);
+		}
+	}
+};
+
+// orders term ordinals by count, highest first, then by term
+struct FacetOrder {
+	const vector<int32_t>& counts;
+	FacetOrder(const vector<int32_t>& c) : counts(c) {}
+	bool operator()(int32_t a, int32_t b) const
+	{
+		return counts[a] > counts[b] || (counts[a] == counts[b] && a < b);
+	}
+};
+
+static void top_facets(PageCollector& collector, const QuerySpec &spec, const vector<FacetField*> &facetFields, QueryResult &result)
+{
+	result.facets.clear();
+	result.facets.resize(facetFields.size());
+
+	for (size_t f = 0; f < facetFields.size(); f++)
+	{
+		FacetResult& facet = result.facets[f];
+		facet.name = spec.facets[f];
+
+		vector<int32_t>& seen = collector.seen[f];
+		size_t top = (size_t) spec.facet_limit;
+		if (top > seen.size())
+			top = seen.size();
+
+		const vector<int32_t>& counts = *collector.counts[f];
+		partial_sort(seen.begin(), seen.begin() + top, seen.end(), FacetOrder(counts));
+
+		facet.counts.resize(top);
+		for (size_t i = 0; i < top; i++)
+		{
+			facet.counts[i].term = facetFields[f]->terms[seen[i]];
+			facet.counts[i].count = counts[seen[i]];
+		}
+	}
+}
+
+// walks the matching documents the way IndexSearcher::_search does, but with the scorer in
+// hand so a search past its deadline stops instead of scoring every remaining match;
+// returns true if it stopped early
+static bool score_hits(IndexSearcher* searcher, Query* query, Filter* filter, uint64_t deadline, PageCollector& collector)
+{
+	IndexReader* reader = searcher->getReader();
+	BitSet* bits = (filter != NULL) ? filter->bits(reader) : NULL;
+	Weight* weight = NULL;
+	Scorer* scorer = NULL;
+	bool timedOut = false;
+
+	try {
+		weight = query->weight(searcher);
+		scorer = weight->scorer(reader);
+
+		if (scorer != NULL)
+		{
+			int32_t scored = 0;
+
+			while (scorer->next())
+			{
+				// the clock is read every 256 matches, not per hit
+				if (deadline > 0 && (++scored & 255) == 0 && Misc::currentTimeMillis() >= deadline)
+				{
+					timedOut = true;
+					break;
+				}
+
+				int32_t doc = scorer->doc();
+				if (bits == NULL || bits->get(doc))
+					collector.collect(doc, scorer->score());
+			}
+		}
+	} catch (CLuceneError &e) {
+		_CLDELETE(scorer);
+		_CLDELETE(weight);
+		if (bits != NULL && filter->shouldDeleteBitSet(bits))
+			_CLDELETE(bits);
+		throw;
+	}
+
+	_CLDELETE(scorer);
+	_CLDELETE(weight);
+	if (bits != NULL && filter->shouldDeleteBitSet(bits))
+		_CLDELETE(bits);
+
+	return timedOut;
+}
+
+// only touches the searcher, so batches can run it on several threads at once;
+// result.truncated is set if the deadline passed, the caller sets it for a parse that ran out of time
+static void search_page(IndexSearcher* searcher, Query* query, Filter* filter, const QuerySpec &spec, const vector<FacetField*> &facetFields,
+	uint64_t deadline, QueryResult &result)
+{
+	// the page of hits to return, skip and limit count from the first hit
+	size_t wanted = (spec.limit > 0) ? (size_t) (spec.skip + spec.limit) : 0;
+
+	PageCollector collector(wanted, facetFields);
+
+	// parsing may already have spent the budget; a search that runs out returns what was
+	// found in time, flagged so the caller knows there may be more
+	if ((deadline > 0 && Misc::currentTimeMillis() >= deadline) || score_hits(searcher, query, filter, deadline, collector))
+		result.truncated = true;
+
+	result.total = collector.total;
+	result.hits.clear();
+
+	// best hit first
+	sort_heap(collector.top.begin(), collector.top.end(), HitOrder());
+
+	// scores are normalised the way Hits does, so they don't change with the collector
+	float_t scoreNorm = (collector.maxScore > 1.0f) ? 1.0f / collector.maxScore : 1.0f;
+
+	size_t end = collector.top.size();
+
+	// one highlighter per requested index, holding the terms the query expanded to for it
+	vector<Highlighter*> highlighters;
+	vector<wstring> highlightFields(spec.highlights.size());
+
+	if (spec.highlights.size() > 0 && end > (size_t) spec.skip)
+	{
+		Query* rewritten = searcher->rewrite(query);
+
+		for (size_t f = 0; f < spec.highlights.size(); f++)
+		{
+			utf8_to_tchar(spec.db + "_" + spec.highlights[f], highlightFields[f]);
+
+			highlighters.push_back(new Highlighter((size_t) spec.highlight_size, (size_t) spec.highlight_count, "<em>", "</em>"));
+			highlighters[f]->add_terms(rewritten, highlightFields[f].c_str());
+			highlighters[f]->add_patterns(query, highlightFields[f].c_str());
+		}
+
+		if (rewritten != query)
+			_CLDELETE(rewritten);
+	}
+
+	Document doc;
+
+	for (size_t i = (size_t) spec.skip; i < end; i++)
+	{
+		doc.clear();
+		searcher->doc(collector.top[i].second, doc);
+
+		Field* fld = doc.getField(WID_FIELD.c_str());
+		if (fld != NULL)
+		{
+			result.hits.push_back(QueryHit());
+			QueryHit& hit = result.hits.back();
+			hit.id = fld->stringValue();
+			hit.score = collector.top[i].first * scoreNorm;
+
+			// fragments come from the stored value, so the document isn't fetched from couchdb
+			hit.highlights.resize(highlighters.size());
+			for (size_t f = 0; f < highlighters.size(); f++)
+				highlighters[f]->highlight(doc.get(highlightFields[f].c_str()), hit.highlights[f]);
+		}
+	}
+
+	for (size_t f = 0; f < highlighters.size(); f++)
+		delete highlighters[f];
+
+	top_facets(collector, spec, facetFields, result);
+}
+
+void CouchLuceneQuery::run_query(const QuerySpec &spec, QueryResult &result)
+{
+	StatsTimer timer(stats, "query");
+	stats.increment("queries." + spec.db + "/" + spec.field.substr(spec.db.length() + 1));
+
+	// use the cached reader for this index, reopened only if the index has changed
+	CachedIndex* index = get_index(spec.db);
+	int64_t version = index->reader->getVersion();
+
+	// results for the same page of the same query are reused until the index changes
+	const string key = QueryCache::make_key(spec);
+	if (queryCache.get(key, version, result))
+	{
+		release_index(index);
+		return;
+	}
+
+	Query* query = NULL;
+	Filter* filter = NULL;
+	vector<FacetField*> facetFields;
+	uint64_t deadline = (spec.timeout > 0) ? Misc::currentTimeMillis() + spec.timeout : 0;
+
+	try {
+		query = parse_query(index, spec.field, spec.q, deadline, result.truncated);
+		filter = make_filter(index, spec);
+		get_facet_fields(index, spec, facetFields);
+
+		search_page(index->searcher, query, filter, spec, facetFields, deadline, result);
+	} catch (CLuceneError &e) {
+		_CLDELETE(filter);
+		_CLDELETE(query);
+		release_index(index);
+		throw;
+	}
+
+	_CLDELETE(filter);
+	_CLDELETE(query);
+	release_index(index);
 
-		// remove _design prefix
-		string term = (*dbName + "_" + name);
+	if (!result.truncated)
+		queryCache.put(key, version, result);
+	else
+		stats.increment("timeouts");
+}
 
-		Json::Value member = ftiObject[name];
+// one query of a batch
+struct BatchJob {
+	QuerySpec spec;
+	Query* query;      // NULL when the result came from the cache or the query failed
+	Filter* filter;
+	uint64_t deadline;
+	vector<FacetField*> facetFields;
+	QueryResult result;
+	string error;
+};
 
-		Field::Store store = Field::STORE_YES;
-		JSScript* script = NULL;
+// the queries of a batch shared between worker threads
+struct BatchWork {
+	IndexSearcher* searcher;
+	vector<BatchJob>* jobs;
+	size_t next;       // next job to take
+	_LUCENE_THREADMUTEX lock;
+};
 
-		// get the defaults and the script
-		Json::Value defaults;
-		defaults = member.get("defaults", 0u);
-		
-		if (defaults.size() > 0)
+static _LUCENE_THREAD_FUNC(batch_worker, arg)
+{
+	BatchWork* work = (BatchWork*) arg;
+
+	while (true)
+	{
+		BatchJob* job = NULL;
 		{
-			// "defaults": {"store": "yes"}
-			// look for store
-			Json::Value store;
-			store = defaults.get("store", 0u);
-			if (store.isString() > 0)
+			SCOPED_LOCK_MUTEX(work->lock);
+			while (work->next < work->jobs->size() && job == NULL)
 			{
-				if (store.asString().compare("no") == 0)
-					store == Field::STORE_NO;
+				BatchJob* candidate = &(*work->jobs)[work->next++];
+				if (candidate->query != NULL)
+					job = candidate;
 			}
 		}
 
+		if (job == NULL)
+			break;
 
-	    // get index, the value is the fti script
-		Json::Value fulltext = 0u;
-		fulltext = member.get("index", 0u);
+		try {
+			search_page(work->searcher, job->query, job->filter, job->spec, job->facetFields, job->deadline, job->result);
+		} catch (CLuceneError &e) {
+			job->error = e.what();
+		}
+	}
 
-		if (fulltext.isString())
-		{
-			string jsStr = fulltext.asString();
-			const char* js = jsStr.c_str();
+	_LUCENE_THREAD_FUNC_RETURN(0);
+}
 
-			jsval result;
-			char *filename = NULL;
-			uintN lineno = 0;
+void CouchLuceneQuery::handle_batch(const string &db, const Json::Value &body, ResponseWriter &out)
+{
+	// {"queries": [{"field": "by_tag", "q": "jer*", "skip": 0, "limit": 10, "include_docs": true}, ...]}
+	Json::Value batch;
+	Json::Reader rdr;
 
-			ostringstream js_stream;
-			// remove _design from ddoc
-			js_stream << "var " << term.c_str() << "=" << js << ";";
-			//js_stream << "var " << name.c_str() << "=" << js << ";";
-			const std::string& tmp = js_stream.str();
-			const char* js_string = tmp.c_str();
-			JSBool ok;
+	if (!body.isString() || !rdr.parse(body.asString(), batch) || !batch["queries"].isArray())
+	{
+		write_error(out, "POST body must be {\"queries\": [...]}", 400);
+		return;
+	}
 
-			ok = JS_EvaluateScript(cx, global, js_string , strlen(js_string),
-											filename, lineno, &result);
-			if (!ok)
+	const Json::Value& queries = batch["queries"];
+
+	if ((long) queries.size() > batchMaxQueries)
+	{
+		write_error(out, "too many queries in batch", 400);
+		return;
+	}
+
+	StatsTimer timer(stats, "batch");
+
+	CachedIndex* index = get_index(db);
+	int64_t version = index->reader->getVersion();
+
+	vector<BatchJob> jobs(queries.size());
+	size_t pending = 0;
+	uint64_t start = Misc::currentTimeMillis();
+
+	// cache lookups, parsing and filters use shared state so they happen on this thread
+	for (Json::Value::UInt i = 0; i < queries.size(); i++)
+	{
+		BatchJob& job = jobs[i];
+		job.query = NULL;
+		job.filter = NULL;
+
+		// looking up a member of an entry that isn't an object throws, so it fails on its own
+		if (!queries[i].isObject())
+			job.error = "query must be an object";
+		else if (!queries[i]["field"].isString())
+			job.error = "query field required";
+		else if (read_query_spec(db, queries[i]["field"].asString(), queries[i], job.spec, job.error))
+		{
+			stats.increment("queries." + db + "/" + job.spec.field.substr(db.length() + 1));
+
+			const string key = QueryCache::make_key(job.spec);
+
+			if (!queryCache.get(key, version, job.result))
 			{
-				wostringstream w;
-				w << js_string;
-				write_error(js_string, 500);
+				try {
+					// every query of the batch has its budget from the start of the request
+					job.deadline = (job.spec.timeout > 0) ? start + job.spec.timeout : 0;
+					job.query = parse_query(index, job.spec.field, job.spec.q, job.deadline, job.result.truncated);
+					job.filter = make_filter(index, job.spec);
+					get_facet_fields(index, job.spec, job.facetFields);
+					pending++;
+				} catch (CLuceneError &e) {
+					_CLDELETE(job.filter);
+					_CLDELETE(job.query);
+					job.error = e.what();
+				}
 			}
 		}
-
-		// fti member map looks like  dbName, (designId, (term name, defaults)
-		ftiMap[*dbName][*designDocName][term.c_str()] = store;
 	}
-}
 
-void CouchLuceneUpdater::get_design_docs()
-{
-	CURL *curl_handle;
-	CURLcode res;
-	ostringstream url;
+	// run the searches that missed the cache in parallel against the shared searcher
+	BatchWork work;
+	work.searcher = index->searcher;
+	work.jobs = &jobs;
+	work.next = 0;
+
+	size_t threads = (size_t) batchThreads;
+	if (threads > pending)
+		threads = pending;
 
-	// clear global response buffer
-	struct write_result write_result;
+	if (threads <= 1)
+		batch_worker(&work);
+	else
+	{
+		vector<_LUCENE_THREADID_TYPE> ids;
+		for (size_t t = 0; t < threads; t++)
+			ids.push_back(_LUCENE_THREAD_CREATE(&batch_worker, &work));
 
-	url << COUCH_HOST << "_all_dbs";
+		for (size_t t = 0; t < ids.size(); t++)
+			_LUCENE_THREAD_JOIN(ids[t]);
+	}
 
-	curl_handle = curl_easy_init();
-	if (curl_handle) 
+	release_index(index);
+
+	// one bulk fetch for the union of ids from every query that asked for docs
+	set<string> docIds;
+	string id;
+
+	for (size_t i = 0; i < jobs.size(); i++)
 	{
-		const std::string& tmp = url.str();
-		const char* url_str = tmp.c_str();
+		BatchJob& job = jobs[i];
 
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_write);
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &write_result);
-		curl_easy_setopt(curl_handle, CURLOPT_URL, url_str);
-		res = curl_easy_perform(curl_handle);
+		if (job.query != NULL)
+		{
+			if (job.error.length() == 0 && !job.result.truncated)
+				queryCache.put(QueryCache::make_key(job.spec), version, job.result);
 
-		// parse the response
-        istringstream resultstream(write_result.buffer);
+			_CLDELETE(job.filter);
+			_CLDELETE(job.query);
+		}
 
-		Json::Value root;
-		Json::Reader reader;
-		bool parsingSuccessful = reader.parse( resultstream, root );                
-		
-		if (parsingSuccessful)
+		if (job.error.length() == 0 && job.spec.include_docs)
 		{
-			// root is an array
-			for (int index = 0; index < root.size(); ++index)
+			for (size_t h = 0; h < job.result.hits.size(); h++)
 			{
-				const string db = root[index].asString();
-
-				// for each db get all design docs and if they have an FTI component then add to the fti map
-				// e.g. http://localhost:5984/db/_all_docs?startkey=%22_design%22&endkey=%22_design0%22&include_docs=true
-				url.str("");
-				
-				struct write_result design_result;
-				url << COUCH_HOST << db.c_str() << "/_all_docs?startkey=%22_design%22&endkey=%22_design0%22&include_docs=true";	
+				tchar_to_utf8(job.result.hits[h].id.c_str(), id);
+				docIds.insert(id);
+			}
+		}
+	}
 
-				const std::string& tmpDesign = url.str();
-				const char* url_design_str = tmpDesign.c_str();
+	map<string, Json::Value> docs;
+	fetch_docs(db, docIds, docs);
 
-				//curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, errorBuffer);
-				curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_write);	
-				curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &design_result);
-				curl_easy_setopt(curl_handle, CURLOPT_URL, url_design_str);
-				res = curl_easy_perform(curl_handle);
+	out.begin_object();
+	out.key("code").number(200);
+	out.key("json").begin_object().key("results").begin_array();
 
-				if (res == CURLE_OK)
-				{
-					Json::Value designRoot;
-					istringstream designstream(design_result.buffer);
-					
-					Json::Reader reader;
-					bool designParsingSuccessful = reader.parse( designstream, designRoot ); 
-					if (designParsingSuccessful)
-					{
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		out.begin_object();
 
-						const Json::Value rows = designRoot["rows"];
-						for (int rowIdx = 0; rowIdx < rows.size(); ++rowIdx)
-						{
-							// see if we have a full text field
-							const string designId = rows[rowIdx]["id"].asString();
-							
-							Json::Value ftiObject;
-							ftiObject = rows[rowIdx]["doc"].get("fulltext", 0u);
-							
-							if (ftiObject.size() > 0)
-							{			
-								parseFTI(&db, &designId, ftiObject);
-							}
-						}
-					}
-					else
-					{
-						// parsing failed
-						write_error(reader.getFormatedErrorMessages(), 400);
-					}
-				}
-				else
-				{
-					write_error("error getting design docs", 500);
-				}
-			}
-		}
+		if (jobs[i].error.length() > 0)
+			out.key("error").string_value(jobs[i].error);
 		else
 		{
-
-			// parsing failed
-			write_error(reader.getFormatedErrorMessages(), 400);
+			write_rows(out, jobs[i].spec, jobs[i].result, jobs[i].spec.include_docs ? &docs : NULL);
+			write_facets(out, jobs[i].result);
 		}
 
-		curl_easy_cleanup(curl_handle);
+		out.end_object();
 	}
-}
 
-/***************************************************
-*
-* CouchLuceneQuery
-*
-*****************************************************/
-CouchLuceneQuery::CouchLuceneQuery(string* dir)
-{
-	indexDir = dir;
+	out.end_array().end_object();
+	out.end_object();
+	out.flush();
 }
 
-CouchLuceneQuery::~CouchLuceneQuery()
-{
-
-}
-void CouchLuceneQuery::get_doc(const char* db, const char* id, string& result)
+void CouchLuceneQuery::fetch_docs(const string &db, const set<string> &ids, map<string, Json::Value> &docs)
 {
-	CURL *curl_handle;
-	CURLcode res;
-	ostringstream url;
+	if (ids.size() == 0)
+		return;
 
-	// clear global response buffer
-	struct write_result write_result;
+	set<string> missing;
+	fetch_doc_rows(db, ids, REPLICA_FIRST, docs, missing);
 
-	url << COUCH_HOST << db << "/" << id;
-
-	curl_handle = curl_easy_init();
-	if (curl_handle) 
+	// a lagging replica answers not_found for docs the index, built from the primary, already has
+	if (!missing.empty() && !couchReplicas.empty())
 	{
-		const std::string& tmp = url.str();
-		const char* url_str = tmp.c_str();
-
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_write);
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &write_result);
-		curl_easy_setopt(curl_handle, CURLOPT_URL, url_str);
-		res = curl_easy_perform(curl_handle);
-
-		// parse the response
-        //istringstream resultstream(write_result.buffer);
-		curl_easy_cleanup(curl_handle);
-		result = string(write_result.buffer);
+		set<string> primaryMissing;
+		stats.increment("replica_misses");
+		fetch_doc_rows(db, missing, PRIMARY_ONLY, docs, primaryMissing);
+		missing.swap(primaryMissing);
 	}
+
+	// docs that are gone are returned as "doc": null, the way CouchDB returns them
+	for (set<string>::const_iterator itr = missing.begin(); itr != missing.end(); ++itr)
+		docs[*itr] = Json::Value();
 }
 
-void CouchLuceneQuery::get_bulk_docs(const char* db, const char* json_request, string& result)
+// adds the rows of one bulk fetch to docs, missing gets the ids that came back without a doc
+void CouchLuceneQuery::fetch_doc_rows(const string &db, const set<string> &ids, CouchRoute route, map<string, Json::Value> &docs, set<string> &missing)
 {
-	CURL *curl_handle;
-	CURLcode res;
-	ostringstream url;
-
-	// clear global response buffer
-	struct write_result write_result;
+	// make a bulk document request
+	// format is {"keys":["bar","baz"]}
+	ResponseWriter keys;
+	keys.begin_object().key("keys").begin_array();
+	for (set<string>::const_iterator itr = ids.begin(); itr != ids.end(); ++itr)
+		keys.string_value(*itr);
+	keys.end_array().end_object();
+
+	string result_doc;
+	{
+		StatsTimer timer(stats, "doc_fetch");
+		get_bulk_docs(db.c_str(), keys.str().c_str(), result_doc, route);
+	}
 
-	url << COUCH_HOST << db << "/" << "_all_docs?include_docs=true";
+	// parse the result
+	Json::Reader rdr;
+	Json::Value resultRoot;
+	istringstream resultstream(result_doc); 
 
-	curl_handle = curl_easy_init();
-	if (curl_handle) 
+	if (rdr.parse(resultstream, resultRoot) && resultRoot.isObject() && resultRoot["rows"].isArray())
 	{
-		const std::string& tmp = url.str();
-		const char* url_str = tmp.c_str();
+		const Json::Value& rows = resultRoot["rows"];
 
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_write);
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &write_result);
-		curl_easy_setopt(curl_handle, CURLOPT_POST, 1);
-		curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, json_request);
-		curl_easy_setopt(curl_handle, CURLOPT_URL, url_str);
-		res = curl_easy_perform(curl_handle);
+		// rows for docs the server doesn't have are {"key": id, "error": "not_found"}
+		for (Json::Value::UInt i = 0; i < rows.size(); i++)
+		{
+			if (rows[i].isObject() && rows[i]["key"].isString() && rows[i]["doc"].isObject())
+				docs[rows[i]["key"].asString()] = rows[i]["doc"];
+		}
+	}
 
-		// parse the response
-        //istringstream resultstream(write_result.buffer);
-		curl_easy_cleanup(curl_handle);
-		result = string(write_result.buffer);
+	for (set<string>::const_iterator itr = ids.begin(); itr != ids.end(); ++itr)
+	{
+		if (docs.count(*itr) == 0)
+			missing.insert(*itr);
 	}
 }
 
-void CouchLuceneQuery::handle_request(const string &request)
+void CouchLuceneQuery::write_rows(ResponseWriter &out, const QuerySpec &spec, const QueryResult &result, const map<string, Json::Value>* docs)
 {
-/*
-	{
-		"info":{
-			"db_name":"test",
-			"doc_count":1,
-			"doc_del_count":1,
-			"update_seq":7,
-			"purge_seq":0,
-			"compact_running":false,
-			"disk_size":28761,
-			"instance_start_time":"1275666414427000",
-			"disk_format_version":5
-			},
-		"id":null,
-		"method":"GET",
-		"path":["test","_fti"],
-		"query":{"q":"request"},
-		"headers":{"Accept":"*\\/*",
-		"Host":"localhost:5984",
-		"User-Agent":"curl/7.17.1 (i586-pc-mingw32msvc) libcurl/7.17.1 OpenSSL/0.9.7e zlib/1.2.3"},
-		"body":"undefined",
-		"peer":"127.0.0.1",
-		"form":{},
-		"cookie":{},
-		"userCtx":{"db":"test","name":null,"roles":["_admin"]}}
-*/
+	string id;
 
-	WhitespaceAnalyzer analyzer;
-
-	// parse the incoming json
-	Json::Value root;
-	Json::Reader reader;
-	istringstream requeststream(request); 
-	bool parsingSuccessful = reader.parse( requeststream, root );
+	out.key("rows").begin_array();
 
-	if (parsingSuccessful)
+	for (size_t i = 0; i < result.hits.size(); i++)
 	{
+		out.begin_object();
+		out.key("id").string_value(result.hits[i].id.c_str());
+		out.key("score").number((double) result.hits[i].score);
 
-		const Json::Value arrPath = root["path"];
-		string db = arrPath[0u].asString();
-
-		string ftiHandler = arrPath[1u].asString();
-
-		if (arrPath.size() > 2)
+		const vector< vector<wstring> >& highlights = result.hits[i].highlights;
+		if (highlights.size() > 0)
 		{
-			// term name is included
-			string term = arrPath[2u].asString();
-
-			// parse the query string
-			Json::Value queryObject = root["query"];
+			// "highlights": {"by_tag": ["a <em>jersey</em> cow", ...]}
+			out.key("highlights").begin_object();
+			for (size_t f = 0; f < highlights.size() && f < spec.highlights.size(); f++)
+			{
+				out.key(spec.highlights[f].c_str()).begin_array();
+				for (size_t n = 0; n < highlights[f].size(); n++)
+					out.string_value(highlights[f][n].c_str());
+				out.end_array();
+			}
+			out.end_object();
+		}
 
-			// is there a query
-			Json::Value query = 0u;
-			query = queryObject.get("q", 0u);
-			
-			Json::Value include_docs = 0u;
-			include_docs = queryObject.get("include_docs", 0u);
+		if (docs != NULL)
+		{
+			tchar_to_utf8(result.hits[i].id.c_str(), id);
 
-			Json::Value skip = 0;
-			skip = queryObject.get("skip", 0);
+			map<string, Json::Value>::const_iterator doc = docs->find(id);
+			if (doc != docs->end())
+				out.key("doc").value(doc->second);
+		}
 
-			Json::Value limit = 0u;
-			limit = queryObject.get("limit", 0u);
+		out.end_object();
+	}
 
-			wostringstream qstream;
-			qstream << query.asString().c_str();
+	out.end_array();
 
-			if (!query.isNull())
-			{
+	if (result.truncated)
+		out.key("truncated").boolean(true);
+}
 
-				const string queryString = queryObject["q"].asString();
+void CouchLuceneQuery::write_results(ResponseWriter &out, const QuerySpec &spec, const QueryResult &result)
+{
+	// do we need to bulk fetch the documents for inclusion
+	map<string, Json::Value> docs;
 
-				// create index reader and perform lucene query
-				stringstream tmpStr;
-				
-				if ((this->indexDir->c_str())[indexDir->length() - 1] == '/')
-					tmpStr << indexDir->c_str() << db.c_str();
-				else
-					tmpStr << indexDir->c_str() << "/" << db.c_str();
+	if (spec.include_docs)
+	{
+		set<string> ids;
+		string id;
 
+		for (size_t i = 0; i < result.hits.size(); i++)
+		{
+			tchar_to_utf8(result.hits[i].id.c_str(), id);
+			ids.insert(id);
+		}
 
-				const std::string& tmpTgt = tmpStr.str();
-				const char* target = tmpTgt.c_str();
+		fetch_docs(spec.db, ids, docs);
+	}
 
-				IndexReader* reader = IndexReader::open(target);
-				IndexSearcher s(reader);
-				
-				wostringstream wFld_stream;
-				wFld_stream << (db + "_" + term).c_str();
-				const wstring& wFldTmp_string = wFld_stream.str();
-				const wchar_t* wfld_string = wFldTmp_string.c_str();
+	// stream the rows straight into the response buffer
+	out.begin_object();
+	out.key("code").number(200);
+	out.key("json").begin_object();
+	write_rows(out, spec, result, spec.include_docs ? &docs : NULL);
+	write_facets(out, result);
+	out.end_object();
+	out.end_object();
+	out.flush();
+}
 
-				wostringstream wQueryStream;
+void CouchLuceneQuery::write_facets(ResponseWriter &out, const QueryResult &result)
+{
+	// "facets": {"by_tag": [{"term": "cat", "count": 12}, ...]}
+	if (result.facets.empty())
+		return;
 
-				wQueryStream << queryString.c_str();
-				const std::wstring& tmp = wQueryStream.str();
-				const TCHAR* wquery_string = tmp.c_str();
+	out.key("facets").begin_object();
 
-				Query* query = QueryParser::parse(wquery_string, wfld_string, &analyzer);	
-				Hits* h = s.search(query);
+	for (size_t f = 0; f < result.facets.size(); f++)
+	{
+		const FacetResult& facet = result.facets[f];
 
-				// create json response
-				Json::Value objResult;
-				Json::Value rows;
+		out.key(facet.name.c_str()).begin_array();
+		for (size_t i = 0; i < facet.counts.size(); i++)
+		{
+			out.begin_object();
+			out.key("term").string_value(facet.counts[i].term.c_str());
+			out.key("count").number((long) facet.counts[i].count);
+			out.end_object();
+		}
+		out.end_array();
+	}
 
-				// create a json array of all document ids
-				Json::Value docIds;
+	out.end_object();
+}
 
-				if (h->length() > 0)
-				{
+// seqDocs is set to the number of live _seq_num documents, which aren't couchdb docs
+long CouchLuceneQuery::indexed_seq(CachedIndex* index, int32_t &seqDocs)
+{
+	// the updater keeps one live document with _seq_num "seq<N>", older ones are deleted
+	// but their terms stay in the dictionary until a merge, so only count live documents
+	seqDocs = 0;
+
+	Term* start = _CLNEW Term(WSEQ_NUM_FIELD.c_str(), WSEQ_NUM_PREFIX.c_str());
+	TermEnum* terms = index->reader->terms(start);
+	TermDocs* docs = index->reader->termDocs();
+	long seq = 0;
+	string text;
+
+	do {
+		Term* term = terms->term(false);
+		if (term == NULL || _tcscmp(term->field(), WSEQ_NUM_FIELD.c_str()) != 0)
+			break;
+
+		docs->seek(terms);
+		int32_t live = 0;
+		while (docs->next())
+			live++;
+
+		if (live > 0)
+		{
+			seqDocs += live;
+			tchar_to_utf8(term->text() + WSEQ_NUM_PREFIX.length(), text);
+			long value = atol(text.c_str());
+			if (value > seq)
+				seq = value;
+		}
+	} while (terms->next());
 
-					int start = skip.asInt();
+	docs->close();
+	_CLDELETE(docs);
+	terms->close();
+	_CLDELETE(terms);
+	_CLDECDELETE(start);
 
-					int end = h->length();
+	return seq;
+}
 
+bool CouchLuceneQuery::read_updater_stats(Json::Value &updater)
+{
+	// the updater is a separate process, it saves its stats after every notification
+	ifstream file(stats_path().c_str());
+	Json::Reader rdr;
 
-					if (limit.asInt() > 0)
-						end = limit.asInt();
+	return file && rdr.parse(file, updater);
+}
 
-					wstringstream wresultstream;
-					wresultstream << end;
+void CouchLuceneQuery::write_stats(const string &db, const Json::Value &info, ResponseWriter &out)
+{
+	// how far the index for this db is behind couchdb, read before anything is written
+	// so an error doesn't leave half a response in out
+	bool indexExists = IndexReader::indexExists(index_path(db).c_str());
+	long indexed = 0;
 
-					for (int32_t i = start; i < end;i++ ){
+	if (indexExists)
+	{
+		CachedIndex* index = get_index(db);
+		int32_t seqDocs;
+
+		try {
+			indexed = indexed_seq(index, seqDocs);
+		} catch (CLuceneError &e) {
+			release_index(index);
+			throw;
+		}
+		release_index(index);
+	}
 
-						Document* doc = &h->doc(i);
-						Json::Value obj;
-						
-						Field* fld = doc->getField(WID_FIELD.c_str());
-						if (fld != NULL)
-						{
+	out.begin_object();
+	out.key("code").number(200);
+	out.key("json").begin_object();
 
-							// get the document id
-							wstring wval = wstring(fld->stringValue());
-							string id = string(wval.length(), ' ');
-							transform(wval.begin(), wval.end(), id.begin(), wide_to_narrow);
-							
-							float score = h->score(i);
+	out.key("query").begin_object();
+	stats.write(out);
+	out.key("query_cache").begin_object();
+	out.key("hits").number(queryCache.hit_count());
+	out.key("misses").number(queryCache.miss_count());
+	out.key("bytes").number((double) queryCache.size_bytes());
+	out.end_object();
+	out.end_object();
 
-							obj["id"] = id;
-							obj["score"] = score;
-							
-							wostringstream w;
-							w << include_docs.asBool();
+	if (indexExists)
+	{
+		out.key("seq").begin_object();
+		out.key("db").string_value(db);
+		out.key("indexed_seq").number(indexed);
+		if (info["update_seq"].isNumeric())
+		{
+			long update_seq = (long) info["update_seq"].asDouble();
+			out.key("update_seq").number(update_seq);
+			out.key("lag").number(update_seq - indexed);
+		}
+		out.end_object();
+	}
 
-							if ((include_docs.isNull() == false) && (include_docs.asBool() == true))
-							{
-								// add the doc
-								// string result_doc;
-								//get_doc(db.c_str(), id.c_str(), result_doc);
-								//obj["doc"] = result_doc;
-								// store doc id for bulk fetch later
-								docIds[i] = id.c_str();
-							}
+	Json::Value updater;
+	if (read_updater_stats(updater))
+		out.key("updater").value(updater);
 
-						}
+	out.end_object();
+	out.end_object();
+	out.flush();
+}
 
-						rows.append(obj);
-					}
-				}
+// segments in the commit the reader has open, read from the header of its segments_N file:
+// format, then for current formats the version and name counter, then the segment count
+static int32_t segment_count(IndexReader* reader)
+{
+	Directory* dir = reader->directory();
+	vector<string> files;
+	dir->list(files);
 
-				s.close();
-				reader->close();
-				_CLDELETE(h);
-				_CLDELETE(query);
-				_CLDELETE(reader);
+	int32_t newestCount = 0;
+	int64_t newest = -1;
 
-				if (rows.size() == 0)
-				{
-					cout << "{\"code\": 200, \"json\": {\"rows\" : []}}" << endl;
-				}
-				else
-				{
-					// do we need to bulk fetch the documents for inclusion
-					if (docIds.size() > 0)
-					{
-						// make a bulk document request
-						// format is {"keys":["bar","baz"]}
-						Json::Value keys;
-						keys["keys"] = docIds;
-						Json::FastWriter wrtr;
-						string json_request = wrtr.write(keys);
-
-						string result_doc;
-						get_bulk_docs(db.c_str(), json_request.c_str(), result_doc);
-
-						// parse the result
-						Json::Reader rdr;
-						Json::Value resultRoot;
-						istringstream resultstream(result_doc); 
-						bool success = rdr.parse(resultstream, resultRoot);
-						if (success)
-						{
-							for (int i = 0; i < rows.size(); i++)
-							{
-								rows[i]["doc"] = resultRoot["rows"][i]["doc"];
-							}
-						}
-						
-					}
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i].compare(0, 9, "segments_") != 0)
+			continue;
 
-					objResult["code"] = 200;
-					objResult["json"]["rows"] = rows;
+		IndexInput* input = NULL;
+		int64_t version = 0;
+		int32_t count;
 
-					// serialize result to cout
-					Json::FastWriter writer;
-					// Make a new JSON document for the configuration. Preserve original comments.
-					string output = writer.write(objResult);
-					cout << output.c_str() << endl;
-				}
+		try {
+			input = dir->openInput(files[i].c_str());
+			int32_t format = input->readInt();
+			if (format < 0)
+			{
+				version = input->readLong();
+				input->readInt();
 			}
-			else
+			count = input->readInt();
+		} catch (CLuceneError &e) {
+			// a commit still being written or already deleted
+			if (input != NULL)
 			{
-				// no query object
-				cout << "{\"code\" : 400, \"body\":\"query parameter q required\"}" << endl;
+				input->close();
+				_CLDELETE(input);
 			}
+			continue;
 		}
-		else
-			cout << "{\"code\" : 400, \"body\":\"query term context required\"}" << endl;
 
+		input->close();
+		_CLDELETE(input);
+
+		if (version == reader->getVersion())
+			return count;
+
+		if (version > newest)
+		{
+			newest = version;
+			newestCount = count;
+		}
 	}
-	else
+
+	// a newer commit has already deleted the reader's
+	return newestCount;
+}
+
+void CouchLuceneQuery::write_info(const string &db, const Json::Value &info, ResponseWriter &out)
+{
+	if (!IndexReader::indexExists(index_path(db).c_str()))
 	{
-		write_error(reader.getFormatedErrorMessages(), 400);
+		write_error(out, "no index for " + db, 404);
+		return;
 	}
-}
 
+	CachedIndex* index = get_index(db);
+	IndexReader* reader = index->reader;
+
+	int32_t docs = reader->numDocs();
+	int32_t deleted = reader->maxDoc() - docs;
+	int64_t version = reader->getVersion();
+	int32_t seqDocs;
+	long indexed;
+	int32_t segments;
+	int64_t diskSize = 0;
+
+	try {
+		indexed = indexed_seq(index, seqDocs);
+		segments = segment_count(reader);
+
+		// every file in the folder, including ones a merge left for deletion
+		Directory* dir = reader->directory();
+		vector<string> files;
+		dir->list(files);
+
+		for (size_t i = 0; i < files.size(); i++)
+			diskSize += dir->fileLength(files[i].c_str());
+	} catch (CLuceneError &e) {
+		release_index(index);
+		throw;
+	}
+
+	release_index(index);
+
+	// the _seq_num config doc isn't a couchdb document
+	docs -= seqDocs;
 
+	out.begin_object();
+	out.key("code").number(200);
+	out.key("json").begin_object();
+	out.key("db_name").string_value(db);
+	out.key("doc_count").number((long) docs);
+	out.key("doc_del_count").number((long) deleted);
+	out.key("segment_count").number((long) segments);
+	out.key("disk_size").number((double) diskSize);
+	out.key("version").number((double) version);
+	out.key("indexed_seq").number(indexed);
+
+	if (info["update_seq"].isNumeric())
+	{
+		long update_seq = (long) info["update_seq"].asDouble();
+		out.key("update_seq").number(update_seq);
+		out.key("seq_lag").number(update_seq - indexed);
+	}
+
+	// optimize runs in the updater, which records when in its stats
+	Json::Value updater;
+	if (read_updater_stats(updater))
+	{
+		const Json::Value& optimized = updater["gauges"]["last_optimize." + db];
+		if (optimized.isNumeric())
+			out.key("last_optimize_ms").value(optimized);
+	}
+
+	out.end_object();
+	out.end_object();
+	out.flush();
+}
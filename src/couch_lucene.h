@@ -2,19 +2,57 @@
 #include <algorithm>
 #include <vector>
 #include <sstream>
+#include <fstream>
 #include <string>
 #include <map>
+#include <list>
+#include <set>
 #include <jsapi.h>
+#include <curl/curl.h>
 #include <json/json.h>
 #include <CLucene.h>
 #include <assert.h>
 
+#include "response_writer.h"
+#include "query_cache.h"
+#include "query_parser.h"
+#include "stats.h"
+
 using namespace std;
 
+typedef map<string, string> Options; // option name, value (from --name=value arguments)
+
+// which CouchDB endpoints a request may use, in order of preference
+enum CouchRoute {
+	PRIMARY_ONLY,   // sequence numbers differ between servers, so _changes stays on one
+	PRIMARY_FIRST,  // then each replica if the primary doesn't answer
+	REPLICA_FIRST   // replicas in turn, the primary last
+};
+
 class CouchLucene {
 protected:
 	string* indexDir;
+	Options options;
+	string couchHost;   // base url ending in '/', from --couch_host
+	vector<string> couchReplicas;  // read replicas in the same form, from --couch_replicas
+	string couchCredentials;       // user:password for basic auth, empty for none
+	long couchConnectTimeout;      // ms, 0 for curl's default
+	long couchTimeout;             // ms for a whole request, 0 for none
+	unsigned long nextReplica;     // replica the next REPLICA_FIRST request starts at
+	_LUCENE_THREADMUTEX hostLock;
+	ResponseWriter out; // reused for every response line written to stdout
+	Stats stats;
+	string stats_path();
 	virtual void write_error(const string &error, int code);
+	void write_error(ResponseWriter &writer, const string &error, int code);
+	string dir_path(const string &name);
+	string index_path(const string &db);
+	string get_option(const char* name, const string &def);
+	long get_long_option(const char* name, long def);
+	bool get_bool_option(const char* name, bool def);
+	void read_couch_host();
+	void prepare_handle(CURL* handle, bool timeout);
+	CURLcode couch_request(CURL* handle, const string &path, string &body, CouchRoute route);
 public:
 	CouchLucene();
 	CouchLucene(string* dir);
@@ -22,37 +60,223 @@ public:
 	virtual void handle_request(const string &request);
 };
 
+// the terms of an untokenized field and the term of each document, for facet counts
+struct FacetField {
+	vector<wstring> terms;  // in index order
+	vector<int32_t> ords;   // doc number, index into terms or -1 for none
+	vector< vector<int32_t>* > spareCounts; // zeroed arrays sized to terms, lent to one search at a time
+	_LUCENE_THREADMUTEX spareLock;
+
+	~FacetField();
+	vector<int32_t>* take_counts();
+	// seen lists the ordinals the search counted, only those are zeroed again
+	void return_counts(vector<int32_t>* counts, const vector<int32_t>& seen);
+};
+
 class CouchLuceneQuery : public CouchLucene {
+private:
+	// an open reader and searcher kept between requests until the index changes
+	struct CachedIndex {
+		lucene::index::IndexReader* reader;
+		lucene::search::IndexSearcher* searcher;
+		int refs;          // requests currently using this index
+		bool stale;        // replaced by a newer reader, closed when the last request releases it
+		_LUCENE_THREADMUTEX filterLock;             // filters and facets
+		map<string, lucene::util::BitSet*> filters; // field and fq clause, matching docs
+		list<string> filterOrder;                    // oldest filter first, for eviction
+		map<string, FacetField*> facets;             // field name, term ordinals
+	};
+	// a request line waiting for a worker thread
+	struct PendingRequest {
+		long seq;
+		string request;
+	};
+	bool useMMap;
+	size_t filterCacheSize; // filters kept per index
+	long batchThreads;
+	long batchMaxQueries;
+	map<string, CachedIndex*> indexCache; // dbName, open index
+	_LUCENE_THREADMUTEX indexLock;         // indexCache and reference counts
+	QueryCache queryCache;
+	QueryLimits queryLimits;
+	int queryTimeout;   // milliseconds, 0 for none
+	void close_index(CachedIndex* index);
+
+	// worker pool, responses are written in the order requests arrived
+	long queryThreads;
+	vector<_LUCENE_THREADID_TYPE> workers;
+	list<PendingRequest> requestQueue;
+	bool shuttingDown;
+	long nextSeq;                         // given to the next request read
+	long nextOutput;                      // next response to write
+	map<long, string> readyResponses;     // finished out of order, seq, response line
+	_LUCENE_THREADMUTEX queueLock;
+	_LUCENE_THREADCOND queueCondition;
+	_LUCENE_THREADMUTEX outputLock;
+	static _LUCENE_THREAD_FUNC(query_worker, arg);
+	void complete_response(long seq, string &lines);
 protected:
+	CachedIndex* get_index(const string &db);
+	void release_index(CachedIndex* index);
+	lucene::util::BitSet* get_filter(CachedIndex* index, const string &field, const string &clause);
+	void get_facet_fields(CachedIndex* index, const QuerySpec &spec, vector<FacetField*> &fields);
+	bool read_query_spec(const string &db, const string &term, const Json::Value &queryObject, QuerySpec &spec, string &error);
+	lucene::search::Query* parse_query(CachedIndex* index, const string &field, const string &q, uint64_t deadline, bool &timedOut);
+	long indexed_seq(CachedIndex* index, int32_t &seqDocs);
+	bool read_updater_stats(Json::Value &updater);
+	void write_stats(const string &db, const Json::Value &info, ResponseWriter &out);
+	void write_info(const string &db, const Json::Value &info, ResponseWriter &out);
+	lucene::search::Filter* make_filter(CachedIndex* index, const QuerySpec &spec);
+	void run_query(const QuerySpec &spec, QueryResult &result);
+	void process_request(const string &request, ResponseWriter &out);
+	void handle_batch(const string &db, const Json::Value &body, ResponseWriter &out);
+	void fetch_docs(const string &db, const set<string> &ids, map<string, Json::Value> &docs);
+	void fetch_doc_rows(const string &db, const set<string> &ids, CouchRoute route, map<string, Json::Value> &docs, set<string> &missing);
+	void write_rows(ResponseWriter &out, const QuerySpec &spec, const QueryResult &result, const map<string, Json::Value>* docs);
+	void write_facets(ResponseWriter &out, const QueryResult &result);
+	void write_results(ResponseWriter &out, const QuerySpec &spec, const QueryResult &result);
 	void get_doc(const char* db, const char* id, string& result);
-	void get_bulk_docs(const char* db, const char* json_request, string& result);
+	void get_bulk_docs(const char* db, const char* json_request, string& result, CouchRoute route);
 public:
-    CouchLuceneQuery(string* dir);
+    CouchLuceneQuery(string* dir, const Options &opts);
 	~CouchLuceneQuery();
 	void handle_request(const string &request);
 };
 
+// how the updater indexes one fulltext term, from its design doc defaults
+struct FieldDef {
+	int flags;         // Field store and index flags
+	int edge_ngrams;   // also index term prefixes up to this length in <term>#ngram, 0 for none
+	vector< vector<string> > required; // member paths the doc must have, split on '.'
+};
+
+// counters for tuning the indexer's SpiderMonkey runtime
+struct JsStats {
+	long docs;             // documents evaluated
+	long gc_checks;        // JS_MaybeGC calls
+	uint64_t gc_time_ms;   // total time spent in JS_MaybeGC
+	uint32_t heap_bytes;   // GC heap size after the last check
+	uint32_t peak_heap_bytes;
+};
+
+// one IndexWriter and the buffers reused by every change it applies
+struct ChangeBatch {
+	lucene::index::IndexWriter* writer;
+	lucene::analysis::WhitespaceAnalyzer an;
+	lucene::document::Document doc;
+	const map<string, map<string, FieldDef> >* fields; // designId, (term, field definition)
+	Json::FastWriter json;
+	string script;
+	wstring wId;
+	wstring wTerm;
+	wstring wValue;
+	wstring wNgrams;
+	vector<unsigned short> jsSource;
+};
+
+// a database followed through a continuous _changes feed
+struct ChangesFeed {
+	string db;
+	CURL* handle;          // NULL while disconnected
+	string lines;          // received but not yet indexed
+	ChangeBatch* batch;    // open while changes wait for a commit
+	long seq;              // last seq read from the feed
+	long committed_seq;    // seq recorded in the index
+	long pending;          // changes in the open batch
+	uint64_t batch_start;
+	uint64_t retry_at;     // reconnect time after the feed ended
+	int commits;           // since the last optimize
+};
+
+// a db whose definitions are loaded
+struct LoadedDb {
+	string db;
+	size_t bytes;   // size of the definitions' JSON, standing in for the compiled functions
+};
+typedef list<LoadedDb> LoadedDbList;
+
 class CouchLuceneUpdater : public CouchLucene {
 private:
 	/* JS variables. */
     JSRuntime *rt;
     JSContext *cx;
     JSObject  *global;
+	long gc_every_docs;    // check for garbage every N docs, 0 to disable
+	long gc_every_bytes;   // or after this many bytes of doc JSON, 0 to disable
+	long gc_docs;          // docs since the last check
+	long gc_bytes;         // doc bytes since the last check
+	JsStats js_stats;
+	void maybe_gc(size_t doc_bytes);
 	int optimize_count;
+	CouchRoute changesRoute;
     map<string, int> updateCntrMap; // dbName, updateCntr
-	map< string, map<string, map <string, string > > > ftiMap; // dbName, (designId, (term, defaults}))
+	map< string, map<string, map <string, FieldDef > > > ftiMap; // dbName, (designId, (term, field definition}))
+	Json::Value designCache;       // dbName, (designId, {_rev, fulltext}), persisted as <db>/_design.json
+	set<string> dirtyDesigns;      // dbs whose designCache entry changed since it was saved
+	LoadedDbList loadedLru;        // dbs whose definitions are in ftiMap, most recently used first
+	map<string, LoadedDbList::iterator> loadedDbs;
+	size_t loadedBytes;
+	size_t loadedBudget;
+	map<string, ChangesFeed*> feeds; // daemon mode, by db
+	map<string, uint64_t> designChecks; // daemon mode, listed db without a feed, now_micros of its last design check
+	list<string> tombstones;       // renamed index directories waiting to be removed
+	bool removerStarted;
+	bool removerStopping;
+	_LUCENE_THREADID_TYPE remover;
+	_LUCENE_THREADMUTEX tombstoneLock;
+	_LUCENE_THREADCOND tombstoneCondition;
+	static _LUCENE_THREAD_FUNC(remove_tombstones, arg);
+	void touch_db(const string& db);
+	void mark_loaded(const string& db);
+	void unload_design_docs(const string& db);
+	void read_design_cache(const string& db);
+	bool load_cached_design(const string& db);
+	void evict_design_cache(const string& db);
+	void save_design_cache();
+	bool save_design_cache(const string& db);
+	string design_cache_path(const string& db);
+	bool get_design_revs(CURL* curl_handle, const string& db, map<string, string>& revs);
+	void parse_design(const string* dbName, const string* designId, const Json::Value& designDoc);
 	void parseFTI(const string* dbName, const string* designDocName, Json::Value& ftiObject);
+	void save_stats();
 protected:
 	// return the last sequence number as the result
 	void optimize(string index);
 	void write_doc(const char* target, lucene::document::Document* doc, lucene::analysis::Analyzer* an, bool create);
+	string read_seq_num(const char* target, bool remove);
+	void put_seq_num(const char* target, long last_seq_num);
 	long addChanges(const char* target, const char* since_seq_num, const string* dbName);
+	void begin_changes(const char* target, const string* dbName, ChangeBatch& batch);
+	void add_change(ChangeBatch& batch, const Json::Value& objChange, const string* dbName);
+	void replace_seq_doc(ChangeBatch& batch, long old_seq, long new_seq);
+	void end_changes(ChangeBatch& batch);
+	void delete_index(const string& dbName);
+	void queue_tombstone(const string& path);
+	void sweep_tombstones();
+	bool get_all_dbs(CURL* curl_handle, vector<string>& dbs);
+	bool db_missing(CURL* curl_handle, const string& db);
+	void load_design_docs(CURL* curl_handle, const string& db);
+	void ensure_design_docs(CURL* curl_handle, const string& db, bool recheck);
+	void refresh_feeds(CURL* handle, CURLM* multi, const set<string>& only, long heartbeat, uint64_t recheckMicros);
+	void connect_feed(CURLM* multi, ChangesFeed* feed, long heartbeat);
+	void disconnect_feed(CURLM* multi, ChangesFeed* feed);
+	void read_feed(ChangesFeed* feed);
+	void commit_feed(ChangesFeed* feed);
+	void reset_feed(CURLM* multi, ChangesFeed* feed, const string& error);
+	void abort_batch(ChangesFeed* feed);
 public:
-    CouchLuceneUpdater(string* dir, int count);
+    CouchLuceneUpdater(string* dir, int count, const Options &opts);
 	~CouchLuceneUpdater();
 	void handle_request(const string &request);
 	void update_index(string index);
 	void get_design_docs();
+	// daemon mode: index every followed db from a continuous _changes feed, never returns
+	void follow_changes();
+	// index a saved _changes or _all_docs response instead of fetching from CouchDB,
+	// returns the seq recorded in the index
+	long import_changes(const string& db, istream& changes, long seq);
+	bool import_design(const string& db, istream& design);
+	const JsStats& get_js_stats() const;
 };
 
 
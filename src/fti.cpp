@@ -3,6 +3,7 @@
 */
 #include <iostream>
 #include <string>
+#include <fstream>
 #include <signal.h>
 #include "couch_lucene.h"
 
@@ -27,35 +28,106 @@ int main(int argc, const char * argv[])
 
 	string line;
 	string update = string("update");
+	string import = string("import");
+	string daemon = string("daemon");
 	string indexDir;
-	int mode = 0; // update mode get design docs
+	Options options;
 	int optimize_count = 1000;
 
 	if(argc < 3)
     {
 		cerr << "incorrect number of arguments" << endl;
-        cerr << "usage: " << argv[0] << " <index_directory>" << " mode" << endl;
+        cerr << "usage: " << argv[0] << " <index_directory>" << " mode" << " [optimize_count] [--option=value ...]" << endl;
+        cerr << "mode is query, update, import or daemon" << endl;
         return 2;
     }
 	else
     {
 		indexDir	= string(argv[1]);
 
-		if (argc == 4)
-			optimize_count = atoi(argv[3]);
+		// optional arguments are either the optimize count or --name=value options
+		for (int i = 3; i < argc; i++)
+		{
+			string arg = string(argv[i]);
+
+			if (arg.compare(0, 2, "--") == 0)
+			{
+				size_t eq = arg.find('=');
+				if (eq != string::npos)
+					options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+				else
+					options[arg.substr(2)] = "true";
+			}
+			else
+				optimize_count = atoi(argv[i]);
+		}
 
 		// execute clucene storing index in argv[1]
 		// mode is in argv[2]
-		if (update.compare(argv[2]) == 0)
+		if (import.compare(argv[2]) == 0)
 		{
-			// update
-			mode = 1; // flag that we need to get the design docs
-			couch = new CouchLuceneUpdater(&indexDir, optimize_count);	
+			// import --db=name [--changes=file] [--design=file] [--seq=N]
+			// indexes a saved _changes or _all_docs response, read from stdin without --changes
+			string db = options["db"];
+			if (db.length() == 0)
+			{
+				cerr << "import needs --db=name" << endl;
+				return 2;
+			}
+
+			CouchLuceneUpdater* updater = new CouchLuceneUpdater(&indexDir, optimize_count, options);
+			couch = updater;
+
+			if (options.count("design") > 0)
+			{
+				ifstream design(options["design"].c_str());
+				if (!design || !updater->import_design(db, design))
+				{
+					cerr << "can't read design doc " << options["design"] << endl;
+					return 1;
+				}
+			}
+
+			long seq = atol(options["seq"].c_str());
+			long last_seq;
+
+			if (options.count("changes") > 0)
+			{
+				ifstream changes(options["changes"].c_str());
+				if (!changes)
+				{
+					cerr << "can't read " << options["changes"] << endl;
+					return 1;
+				}
+				last_seq = updater->import_changes(db, changes, seq);
+			}
+			else
+				last_seq = updater->import_changes(db, cin, seq);
+
+			cerr << "indexed " << db << " to seq " << last_seq << endl;
+
+			delete couch;
+			return 0;
+		}
+		else if (daemon.compare(argv[2]) == 0)
+		{
+			// daemon: follow continuous _changes feeds instead of waiting for update notifications
+			CouchLuceneUpdater* updater = new CouchLuceneUpdater(&indexDir, optimize_count, options);
+			couch = updater;
+			updater->follow_changes();
+
+			delete couch;
+			return 0;
+		}
+		else if (update.compare(argv[2]) == 0)
+		{
+			// update, design docs are loaded per db on its first notification
+			couch = new CouchLuceneUpdater(&indexDir, optimize_count, options);	
 		}
 		else
 		{
 			// query
-			couch = new CouchLuceneQuery(&indexDir);
+			couch = new CouchLuceneQuery(&indexDir, options);
 		}
 
 
@@ -64,24 +136,16 @@ int main(int argc, const char * argv[])
 			getline(cin, line);
             if (line.length() > 0)
 			{
-				if (mode == 1)
-				{
-					// on the first request get the design docs
-					((CouchLuceneUpdater*)couch)->get_design_docs();
-					mode = 0;
-				}
 				try {
 					couch->handle_request(line);
 				} catch (CLuceneError &e) {
 
-					Json::Value response;
-					response["code"] = 500;
-					response["body"] = e.what();
-					Json::FastWriter writer;
-
-					// Make a new JSON document.
-					std::string output = writer.write( response );
-					cout << output.c_str() << endl; 
+					ResponseWriter out;
+					out.begin_object();
+					out.key("code").number(500);
+					out.key("body").string_value(string(e.what()));
+					out.end_object();
+					out.flush();
 				}
 			}
 			else
@@ -0,0 +1,237 @@
+#include <wctype.h>
+
+#include "highlighter.h"
+#include "query_parser.h"
+#include "utf8.h"
+
+using namespace lucene::index;
+using namespace lucene::search;
+
+Highlighter::Highlighter(size_t fragment_size, size_t max_fragments, const string& pre_tag, const string& post_tag)
+{
+	fragmentSize = fragment_size;
+	maxFragments = max_fragments;
+	utf8_to_tchar(pre_tag, pre);
+	utf8_to_tchar(post_tag, post);
+}
+
+// * matches any run of characters and ? any one, as in a WildcardQuery
+static bool wildcard_match(const TCHAR* pattern, const TCHAR* text)
+{
+	const TCHAR* star = NULL;
+	const TCHAR* resume = NULL;
+
+	while (*text != 0)
+	{
+		if (*pattern == '?' || (*pattern != '*' && *pattern == *text))
+		{
+			pattern++;
+			text++;
+		}
+		else if (*pattern == '*')
+		{
+			star = pattern++;
+			resume = text;
+		}
+		else if (star != NULL)
+		{
+			// let the last * take one more character
+			pattern = star + 1;
+			text = ++resume;
+		}
+		else
+			return false;
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == 0;
+}
+
+// escapes the characters that would make a stored value markup
+static void append_escaped(wstring& out, const wstring& value, size_t start, size_t count)
+{
+	for (size_t i = start; i < start + count; i++)
+	{
+		switch (value[i])
+		{
+		case '&': out += L"&amp;"; break;
+		case '<': out += L"&lt;"; break;
+		case '>': out += L"&gt;"; break;
+		case '"': out += L"&quot;"; break;
+		default: out += value[i];
+		}
+	}
+}
+
+void Highlighter::add_terms(Query* query, const TCHAR* field)
+{
+	TermSet termSet;
+	query->extractTerms(&termSet);
+
+	// a prefix query on an index with edge n-grams is a term of its n-gram field
+	wstring ngramField(field);
+	ngramField += WNGRAM_SUFFIX;
+
+	for (TermSet::iterator itr = termSet.begin(); itr != termSet.end(); ++itr)
+	{
+		Term* term = *itr;
+
+		if (_tcscmp(term->field(), field) == 0)
+			terms.insert(term->text());
+		else if (ngramField.compare(term->field()) == 0)
+			prefixes.insert(term->text());
+
+		// extractTerms hands back a reference to each term
+		_CLDECDELETE(term);
+	}
+}
+
+void Highlighter::add_patterns(Query* query, const TCHAR* field)
+{
+	if (query->instanceOf(ExpandedTermQuery::getClassName()))
+	{
+		ExpandedTermQuery* expanded = (ExpandedTermQuery*) query;
+		if (expanded->get_field().compare(field) == 0)
+		{
+			if (expanded->is_prefix())
+				prefixes.insert(expanded->get_pattern());
+			else
+				patterns.insert(expanded->get_pattern());
+		}
+	}
+	else if (query->instanceOf(BooleanQuery::getClassName()))
+	{
+		BooleanQuery* boolean = (BooleanQuery*) query;
+		vector<BooleanClause*> clauses(boolean->getClauseCount());
+
+		if (clauses.size() > 0)
+			boolean->getClauses(&clauses[0]);
+
+		for (size_t i = 0; i < clauses.size(); i++)
+		{
+			if (!clauses[i]->isProhibited())
+				add_patterns(clauses[i]->getQuery(), field);
+		}
+	}
+}
+
+bool Highlighter::has_terms() const
+{
+	return !terms.empty() || !prefixes.empty() || !patterns.empty();
+}
+
+bool Highlighter::matches(const wstring& token) const
+{
+	if (terms.find(token) != terms.end())
+		return true;
+
+	for (set<wstring>::const_iterator itr = prefixes.begin(); itr != prefixes.end(); ++itr)
+	{
+		if (token.compare(0, itr->length(), *itr) == 0)
+			return true;
+	}
+
+	for (set<wstring>::const_iterator itr = patterns.begin(); itr != patterns.end(); ++itr)
+	{
+		if (wildcard_match(itr->c_str(), token.c_str()))
+			return true;
+	}
+
+	return false;
+}
+
+void Highlighter::highlight(const TCHAR* value, vector<wstring>& fragments) const
+{
+	fragments.clear();
+
+	if (value == NULL || !has_terms())
+		return;
+
+	const wstring text(value);
+	const size_t length = text.length();
+	vector<size_t> starts;
+	vector<size_t> ends;
+
+	if (matches(text))
+	{
+		// untokenized, the whole value is the term
+		starts.push_back(0);
+		ends.push_back(length);
+	}
+	else
+	{
+		wstring token;
+		size_t pos = 0;
+
+		while (pos < length)
+		{
+			while (pos < length && iswspace(text[pos]))
+				pos++;
+
+			size_t start = pos;
+			while (pos < length && !iswspace(text[pos]))
+				pos++;
+
+			if (pos > start)
+			{
+				token.assign(text, start, pos - start);
+				if (matches(token))
+				{
+					starts.push_back(start);
+					ends.push_back(pos);
+				}
+			}
+		}
+	}
+
+	size_t m = 0;
+	while (m < starts.size() && fragments.size() < maxFragments)
+	{
+		// centre the first match not yet shown
+		size_t matchLength = ends[m] - starts[m];
+		size_t context = (matchLength < fragmentSize) ? (fragmentSize - matchLength) / 2 : 0;
+		size_t start = (starts[m] > context) ? starts[m] - context : 0;
+
+		// don't start or end part way through a token
+		while (start > 0 && start < starts[m] && !iswspace(text[start - 1]))
+			start++;
+		while (start < starts[m] && iswspace(text[start]))
+			start++;
+
+		size_t end = start + fragmentSize;
+		if (end < ends[m])
+			end = ends[m];
+		if (end > length)
+			end = length;
+
+		while (end < length && end > ends[m] && !iswspace(text[end]))
+			end--;
+		while (end > ends[m] && iswspace(text[end - 1]))
+			end--;
+
+		fragments.push_back(wstring());
+		append_fragment(text, start, end, starts, ends, m, fragments.back());
+
+		while (m < starts.size() && starts[m] < end)
+			m++;
+	}
+}
+
+void Highlighter::append_fragment(const wstring& value, size_t start, size_t end,
+	const vector<size_t>& matchStarts, const vector<size_t>& matchEnds, size_t first, wstring& fragment) const
+{
+	size_t pos = start;
+
+	for (size_t k = first; k < matchStarts.size() && matchEnds[k] <= end; k++)
+	{
+		append_escaped(fragment, value, pos, matchStarts[k] - pos);
+		fragment += pre;
+		append_escaped(fragment, value, matchStarts[k], matchEnds[k] - matchStarts[k]);
+		fragment += post;
+		pos = matchEnds[k];
+	}
+
+	append_escaped(fragment, value, pos, end - pos);
+}
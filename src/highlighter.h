@@ -0,0 +1,48 @@
+#ifndef HIGHLIGHTER_H
+#define HIGHLIGHTER_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <CLucene.h>
+
+using namespace std;
+
+/**
+* Builds short fragments of a stored field value with the query's terms marked,
+* so search results can show the match without fetching the whole document.
+*
+* Values are split on whitespace, the same way WhitespaceAnalyzer split them
+* when they were indexed, so a token matches if it is one of the terms the
+* query expanded to for that field. Terms of the field's edge n-grams and
+* filtered prefix and wildcard terms match tokens as patterns. The value is
+* HTML-escaped around the tags.
+*/
+class Highlighter {
+private:
+	set<wstring> terms;
+	set<wstring> prefixes;
+	set<wstring> patterns;  // wildcard terms, * and ?
+	size_t fragmentSize;   // approximate characters per fragment
+	size_t maxFragments;
+	wstring pre;           // inserted before and after each matched token
+	wstring post;
+
+	void append_fragment(const wstring& value, size_t start, size_t end,
+		const vector<size_t>& matchStarts, const vector<size_t>& matchEnds, size_t first, wstring& fragment) const;
+	bool matches(const wstring& token) const;
+public:
+	Highlighter(size_t fragment_size, size_t max_fragments, const string& pre_tag, const string& post_tag);
+
+	// the terms of field in an already rewritten query, prefix and wildcard queries must be expanded first
+	void add_terms(lucene::search::Query* query, const TCHAR* field);
+	// the prefix and wildcard terms of field matched through filters, which rewriting doesn't expand;
+	// pass the query as parsed, rewriting may copy them into plain ConstantScoreQuerys
+	void add_patterns(lucene::search::Query* query, const TCHAR* field);
+	bool has_terms() const;
+
+	// replaces fragments with up to max_fragments pieces of value, none if no term matches
+	void highlight(const TCHAR* value, vector<wstring>& fragments) const;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+
+#include "query_cache.h"
+
+// bookkeeping per entry: list node, map node and the key stored in the map
+static const size_t ENTRY_OVERHEAD = 128;
+
+QueryCache::QueryCache()
+{
+	budget = 0;
+	used = 0;
+	hits = 0;
+	misses = 0;
+}
+
+void QueryCache::set_budget(size_t budget_bytes)
+{
+	SCOPED_LOCK_MUTEX(lock);
+	budget = budget_bytes;
+
+	while (used > budget && !lru.empty())
+	{
+		EntryList::iterator last = lru.end();
+		--last;
+		erase(last);
+	}
+}
+
+// each part is its length, ':' and its bytes, so no value can run into the next one
+static void append_part(string& key, const string& part)
+{
+	char length[24];
+	sprintf(length, "%lu:", (unsigned long) part.length());
+	key += length;
+	key += part;
+}
+
+// a list is its count followed by its parts
+static void append_parts(string& key, const vector<string>& parts)
+{
+	char count[24];
+	sprintf(count, "%lu;", (unsigned long) parts.size());
+	key += count;
+
+	for (size_t i = 0; i < parts.size(); i++)
+		append_part(key, parts[i]);
+}
+
+string QueryCache::make_key(const QuerySpec& spec)
+{
+	char page[96];
+	sprintf(page, "%d:%d:%d:%d:%d;", spec.skip, spec.limit, spec.facet_limit, spec.highlight_size, spec.highlight_count);
+
+	string key;
+	key.reserve(spec.db.length() + spec.field.length() + spec.q.length() + 32 * (spec.fq.size() + spec.facets.size() + spec.highlights.size() + 1));
+	key += page;
+	append_part(key, spec.db);
+	append_part(key, spec.field);
+	append_part(key, spec.q);
+
+	// filter clauses, facets and highlights are sorted by the caller, so their order in the request doesn't matter
+	append_parts(key, spec.fq);
+	append_parts(key, spec.facets);
+	append_parts(key, spec.highlights);
+
+	return key;
+}
+
+size_t QueryCache::entry_bytes(const string& key, const QueryResult& result)
+{
+	size_t bytes = ENTRY_OVERHEAD + 2 * key.length() + result.hits.capacity() * sizeof(QueryHit);
+
+	for (size_t i = 0; i < result.hits.size(); i++)
+	{
+		const QueryHit& hit = result.hits[i];
+		bytes += hit.id.capacity() * sizeof(TCHAR);
+
+		for (size_t h = 0; h < hit.highlights.size(); h++)
+		{
+			bytes += sizeof(vector<wstring>) + hit.highlights[h].capacity() * sizeof(wstring);
+
+			for (size_t f = 0; f < hit.highlights[h].size(); f++)
+				bytes += hit.highlights[h][f].capacity() * sizeof(TCHAR);
+		}
+	}
+
+	for (size_t f = 0; f < result.facets.size(); f++)
+	{
+		const FacetResult& facet = result.facets[f];
+		bytes += sizeof(FacetResult) + facet.name.capacity() + facet.counts.capacity() * sizeof(FacetCount);
+
+		for (size_t i = 0; i < facet.counts.size(); i++)
+			bytes += facet.counts[i].term.capacity() * sizeof(TCHAR);
+	}
+
+	return bytes;
+}
+
+void QueryCache::erase(EntryList::iterator itr)
+{
+	used -= itr->bytes;
+	entries.erase(itr->key);
+	lru.erase(itr);
+}
+
+bool QueryCache::get(const string& key, int64_t version, QueryResult& result)
+{
+	SCOPED_LOCK_MUTEX(lock);
+	map<string, EntryList::iterator>::iterator found = entries.find(key);
+
+	if (found != entries.end())
+	{
+		EntryList::iterator itr = found->second;
+
+		if (itr->version == version)
+		{
+			// move to the front of the lru list
+			lru.splice(lru.begin(), lru, itr);
+			result = itr->result;
+			hits++;
+			return true;
+		}
+
+		// computed from an older index
+		erase(itr);
+	}
+
+	misses++;
+	return false;
+}
+
+void QueryCache::put(const string& key, int64_t version, const QueryResult& result)
+{
+	SCOPED_LOCK_MUTEX(lock);
+	size_t bytes = entry_bytes(key, result);
+
+	// results larger than the whole budget are not worth evicting everything else for
+	if (bytes > budget)
+		return;
+
+	map<string, EntryList::iterator>::iterator found = entries.find(key);
+	if (found != entries.end())
+		erase(found->second);
+
+	while (used + bytes > budget && !lru.empty())
+	{
+		EntryList::iterator last = lru.end();
+		--last;
+		erase(last);
+	}
+
+	Entry entry;
+	entry.key = key;
+	entry.version = version;
+	entry.bytes = bytes;
+	lru.push_front(entry);
+	lru.front().result = result;
+
+	entries[key] = lru.begin();
+	used += bytes;
+}
+
+size_t QueryCache::size_bytes() const
+{
+	SCOPED_LOCK_MUTEX(lock);
+	return used;
+}
+
+long QueryCache::hit_count() const
+{
+	SCOPED_LOCK_MUTEX(lock);
+	return hits;
+}
+
+long QueryCache::miss_count() const
+{
+	SCOPED_LOCK_MUTEX(lock);
+	return misses;
+}
@@ -0,0 +1,98 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <CLucene.h>
+
+using namespace std;
+
+// one search against an index, from the request path and query string
+struct QuerySpec {
+	string db;
+	string field;            // index field name, dbName_term
+	string q;
+	int skip;
+	int limit;               // 0 for all hits
+	bool include_docs;
+	vector<string> fq;       // filter clauses, sorted
+	vector<string> facets;   // index names to count terms of, sorted
+	int facet_limit;         // terms returned per facet
+	vector<string> highlights; // index names to return marked fragments of, sorted
+	int highlight_size;      // approximate characters per fragment
+	int highlight_count;     // fragments per field
+	int timeout;             // milliseconds to search for, 0 for no limit; only complete results are cached
+};
+
+struct QueryHit {
+	wstring id;
+	float score;
+	vector< vector<wstring> > highlights; // per highlighted index, fragments
+};
+
+struct FacetCount {
+	wstring term;
+	int32_t count;
+};
+
+// the most frequent terms of one field over every matching document
+struct FacetResult {
+	string name;
+	vector<FacetCount> counts; // highest count first
+};
+
+// the page of hits for one query against one version of an index
+struct QueryResult {
+	int32_t total;           // number of matching documents
+	vector<QueryHit> hits;   // hits between skip and skip + limit
+	vector<FacetResult> facets;
+	bool truncated;          // the search ran out of time, total and hits cover the documents seen so far
+};
+
+/**
+* LRU cache of query results bounded by an approximate memory budget.
+*
+* Each entry is tagged with the version of the index it was computed from;
+* a lookup with a newer version drops the entry, so results are invalidated
+* as soon as the updater commits and the query process reopens the reader.
+*/
+class QueryCache {
+private:
+	struct Entry {
+		string key;
+		int64_t version;
+		size_t bytes;
+		QueryResult result;
+	};
+	typedef list<Entry> EntryList;
+
+	size_t budget;
+	size_t used;
+	EntryList lru; // most recently used first
+	map<string, EntryList::iterator> entries;
+	long hits;
+	long misses;
+	mutable _LUCENE_THREADMUTEX lock; // shared by the query worker threads
+
+	void erase(EntryList::iterator itr);
+	static size_t entry_bytes(const string& key, const QueryResult& result);
+public:
+	QueryCache();
+
+	// 0 disables caching
+	void set_budget(size_t budget_bytes);
+
+	// key from the normalised query parameters
+	static string make_key(const QuerySpec& spec);
+
+	bool get(const string& key, int64_t version, QueryResult& result);
+	void put(const string& key, int64_t version, const QueryResult& result);
+
+	size_t size_bytes() const;
+	long hit_count() const;
+	long miss_count() const;
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include <wctype.h>
+
+#include "query_parser.h"
+
+using namespace lucene::index;
+using namespace lucene::search;
+using namespace lucene::queryParser;
+using namespace lucene::util;
+
+ExpandedTermQuery::ExpandedTermQuery(Filter* filter, const TCHAR* fieldName, const wstring& termPattern, bool isPrefix)
+	: ConstantScoreQuery(filter), field(fieldName), pattern(termPattern), prefix(isPrefix)
+{
+}
+
+const char* ExpandedTermQuery::getClassName()
+{
+	return "ExpandedTermQuery";
+}
+
+const char* ExpandedTermQuery::getObjectName() const
+{
+	return getClassName();
+}
+
+GuardedQueryParser::GuardedQueryParser(const TCHAR* field, lucene::analysis::Analyzer* analyzer,
+	IndexReader* indexReader, const QueryLimits& queryLimits, uint64_t stopAt)
+	: QueryParser(field, analyzer), reader(indexReader), limits(queryLimits), deadline(stopAt), timedOut(false)
+{
+}
+
+bool GuardedQueryParser::out_of_time()
+{
+	if (!timedOut && deadline > 0 && Misc::currentTimeMillis() >= deadline)
+		timedOut = true;
+
+	return timedOut;
+}
+
+size_t GuardedQueryParser::count_terms(const TCHAR* field, const wstring& prefix, size_t limit)
+{
+	// stops one past the limit, the exact count of a huge expansion isn't needed
+	Term* start = _CLNEW Term(field, prefix.c_str());
+	TermEnum* terms = reader->terms(start);
+	size_t count = 0;
+
+	do {
+		Term* term = terms->term(false);
+		if (term == NULL || _tcscmp(term->field(), field) != 0 || _tcsncmp(term->text(), prefix.c_str(), prefix.length()) != 0)
+			break;
+
+		count++;
+
+		// a long walk over the term dictionary counts against the search's time budget
+		if ((count & 63) == 0 && out_of_time())
+			break;
+	} while (count <= limit && terms->next());
+
+	terms->close();
+	_CLDELETE(terms);
+	_CLDECDELETE(start);
+
+	return count;
+}
+
+void GuardedQueryParser::check_expansion(const TCHAR* field, const wstring& prefix, size_t& terms)
+{
+	if (prefix.length() < limits.minPrefixLength)
+		_CLTHROWA(CL_ERR_Parse, "prefix or wildcard term is shorter than min_prefix_length");
+
+	terms = count_terms(field, prefix, limits.maxExpandedTerms);
+
+	if (terms > limits.maxExpandedTerms)
+		_CLTHROWA(CL_ERR_Parse, "prefix or wildcard term matches more than max_expanded_terms terms");
+}
+
+Query* GuardedQueryParser::getPrefixQuery(const TCHAR* field, TCHAR* termStr)
+{
+	if (out_of_time())
+		return _CLNEW BooleanQuery();
+
+	// expanded terms are lowercased by the base parser, check the term it will search for
+	wstring prefix(termStr);
+	for (size_t i = 0; i < prefix.length(); i++)
+		prefix[i] = (TCHAR) towlower(prefix[i]);
+
+	// an index with edge n-grams holds every prefix of its terms as a term of its own
+	wstring ngramField(field);
+	ngramField += WNGRAM_SUFFIX;
+
+	Term* ngram = _CLNEW Term(ngramField.c_str(), prefix.c_str());
+	if (prefix.length() > 0 && reader->docFreq(ngram) > 0)
+	{
+		Query* query = _CLNEW TermQuery(ngram);
+		_CLDECDELETE(ngram);
+		return query;
+	}
+	_CLDECDELETE(ngram);
+
+	size_t terms;
+	check_expansion(field, prefix, terms);
+
+	if (timedOut)
+		return _CLNEW BooleanQuery();
+
+	if (terms > limits.constantScoreTerms)
+	{
+		Term* term = _CLNEW Term(field, prefix.c_str());
+		Query* query = _CLNEW ExpandedTermQuery(_CLNEW PrefixFilter(term), field, prefix, true);
+		_CLDECDELETE(term);
+		return query;
+	}
+
+	return QueryParser::getPrefixQuery(field, termStr);
+}
+
+Query* GuardedQueryParser::getWildcardQuery(const TCHAR* field, TCHAR* termStr)
+{
+	if (out_of_time())
+		return _CLNEW BooleanQuery();
+
+	wstring pattern(termStr);
+	for (size_t i = 0; i < pattern.length(); i++)
+		pattern[i] = (TCHAR) towlower(pattern[i]);
+
+	// the literal characters before the first wildcard bound the terms it can match
+	size_t literal = pattern.find_first_of(L"*?");
+	const wstring prefix = pattern.substr(0, literal);
+
+	size_t terms;
+	check_expansion(field, prefix, terms);
+
+	if (timedOut)
+		return _CLNEW BooleanQuery();
+
+	if (terms > limits.constantScoreTerms)
+	{
+		Term* term = _CLNEW Term(field, pattern.c_str());
+		Query* query = _CLNEW ExpandedTermQuery(_CLNEW WildcardFilter(term), field, pattern, false);
+		_CLDECDELETE(term);
+		return query;
+	}
+
+	return QueryParser::getWildcardQuery(field, termStr);
+}
@@ -0,0 +1,71 @@
+#ifndef QUERY_PARSER_H
+#define QUERY_PARSER_H
+
+#include <string>
+#include <CLucene.h>
+
+using namespace std;
+
+// suffix of the field holding the edge n-grams of an index, see FieldDef; '#' can't
+// appear in a fulltext name, so it never names another index
+static const wstring WNGRAM_SUFFIX = L"#ngram";
+
+// limits on how far prefix and wildcard terms may expand
+struct QueryLimits {
+	size_t minPrefixLength;      // literal characters required before a * or ?
+	size_t constantScoreTerms;   // larger expansions match through a filter instead of a BooleanQuery
+	size_t maxExpandedTerms;     // larger expansions are rejected
+};
+
+// a prefix or wildcard term matched through a filter, keeping the term so the
+// highlighter can mark what the filter matched
+class ExpandedTermQuery : public lucene::search::ConstantScoreQuery {
+private:
+	wstring field;
+	wstring pattern;
+	bool prefix;
+public:
+	ExpandedTermQuery(lucene::search::Filter* filter, const TCHAR* fieldName, const wstring& termPattern, bool isPrefix);
+
+	const wstring& get_field() const { return field; }
+	const wstring& get_pattern() const { return pattern; }
+	bool is_prefix() const { return prefix; }
+
+	static const char* getClassName();
+	const char* getObjectName() const;
+};
+
+/**
+* QueryParser that checks prefix and wildcard terms against the index before
+* they are expanded.
+*
+* Terms shorter than the minimum prefix or matching more than the maximum
+* number of index terms throw CLuceneError(CL_ERR_Parse), which the query
+* handler returns as a 400. Large expansions become a ConstantScoreQuery over
+* a prefix or wildcard filter, and a prefix with an edge n-gram field is a
+* single term lookup.
+*
+* Expansion stops at the search's deadline: the term is replaced by a query
+* matching nothing and timed_out() reports that the results are incomplete.
+*/
+class GuardedQueryParser : public lucene::queryParser::QueryParser {
+private:
+	lucene::index::IndexReader* reader;
+	const QueryLimits& limits;
+	uint64_t deadline;           // currentTimeMillis to stop expanding at, 0 for none
+	bool timedOut;
+
+	bool out_of_time();
+	size_t count_terms(const TCHAR* field, const wstring& prefix, size_t limit);
+	void check_expansion(const TCHAR* field, const wstring& prefix, size_t& terms);
+protected:
+	lucene::search::Query* getPrefixQuery(const TCHAR* field, TCHAR* termStr);
+	lucene::search::Query* getWildcardQuery(const TCHAR* field, TCHAR* termStr);
+public:
+	GuardedQueryParser(const TCHAR* field, lucene::analysis::Analyzer* analyzer,
+		lucene::index::IndexReader* indexReader, const QueryLimits& queryLimits, uint64_t stopAt);
+
+	bool timed_out() const { return timedOut; }
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+
+#include "response_writer.h"
+#include "utf8.h"
+
+#ifdef _MSC_VER
+    #include <io.h>
+    #define WRITE(fd, buf, len) _write(fd, buf, (unsigned int) len)
+#else
+    #include <unistd.h>
+    #define WRITE(fd, buf, len) write(fd, buf, len)
+#endif
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static void append_escaped(string& out, unsigned int c)
+{
+	switch (c)
+	{
+	case '"':  out += "\\\""; break;
+	case '\\': out += "\\\\"; break;
+	case '\b': out += "\\b"; break;
+	case '\f': out += "\\f"; break;
+	case '\n': out += "\\n"; break;
+	case '\r': out += "\\r"; break;
+	case '\t': out += "\\t"; break;
+	default:
+		// remaining control characters as \u00XX
+		out += "\\u00";
+		out += HEX_DIGITS[(c >> 4) & 0xf];
+		out += HEX_DIGITS[c & 0xf];
+	}
+}
+
+ResponseWriter::ResponseWriter(int fd)
+{
+	this->fd = fd;
+	after_key = false;
+}
+
+void ResponseWriter::separate()
+{
+	// a value directly after its key, or the first value in a container, needs no comma
+	if (after_key)
+	{
+		after_key = false;
+		return;
+	}
+
+	if (!first.empty())
+	{
+		if (first.back())
+			first.back() = false;
+		else
+			buffer += ',';
+	}
+}
+
+ResponseWriter& ResponseWriter::begin_object()
+{
+	separate();
+	buffer += '{';
+	first.push_back(true);
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::end_object()
+{
+	buffer += '}';
+	first.pop_back();
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::begin_array()
+{
+	separate();
+	buffer += '[';
+	first.push_back(true);
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::end_array()
+{
+	buffer += ']';
+	first.pop_back();
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::key(const char* name)
+{
+	string_value(name, strlen(name));
+	buffer += ':';
+	after_key = true;
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::string_value(const char* value, size_t length)
+{
+	separate();
+	buffer += '"';
+
+	// utf-8 bytes are copied through, only quotes, backslashes and control characters are escaped
+	const char* start = value;
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned char c = (unsigned char) value[i];
+		if (c < 0x20 || c == '"' || c == '\\')
+		{
+			buffer.append(start, value + i - start);
+			append_escaped(buffer, c);
+			start = value + i + 1;
+		}
+	}
+	buffer.append(start, value + length - start);
+
+	buffer += '"';
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::string_value(const string& value)
+{
+	return string_value(value.data(), value.length());
+}
+
+ResponseWriter& ResponseWriter::string_value(const TCHAR* value)
+{
+	// encode into the reusable scratch buffer, then escape as any utf-8 string
+	tchar_to_utf8(value, scratch);
+	return string_value(scratch.data(), scratch.length());
+}
+
+ResponseWriter& ResponseWriter::number(int value)
+{
+	return number((long) value);
+}
+
+ResponseWriter& ResponseWriter::number(long value)
+{
+	char tmp[32];
+	sprintf(tmp, "%ld", value);
+
+	separate();
+	buffer += tmp;
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::number(double value)
+{
+	separate();
+
+	// JSON has no NaN or infinity
+	if (value != value || value > DBL_MAX || value < -DBL_MAX)
+	{
+		buffer += "null";
+		return *this;
+	}
+
+	// 15 digits are exact for most values (0.1 stays 0.1), 17 always read back the same double
+	char tmp[32];
+	sprintf(tmp, "%.15g", value);
+	if (strtod(tmp, NULL) != value)
+		sprintf(tmp, "%.17g", value);
+
+	buffer += tmp;
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::boolean(bool value)
+{
+	separate();
+	buffer += value ? "true" : "false";
+	return *this;
+}
+
+ResponseWriter& ResponseWriter::value(const Json::Value& value)
+{
+	Json::FastWriter writer;
+	string json = writer.write(value);
+
+	// FastWriter terminates the document with a newline
+	if (json.length() > 0 && json[json.length() - 1] == '\n')
+		json.erase(json.length() - 1);
+
+	return raw(json.data(), json.length());
+}
+
+ResponseWriter& ResponseWriter::raw(const char* json, size_t length)
+{
+	separate();
+	buffer.append(json, length);
+	return *this;
+}
+
+const string& ResponseWriter::str() const
+{
+	return buffer;
+}
+
+void ResponseWriter::clear()
+{
+	// keeps the allocated capacity for the next response
+	buffer.erase();
+	first.clear();
+	after_key = false;
+}
+
+void ResponseWriter::flush()
+{
+	buffer += '\n';
+
+	if (fd < 0)
+		lines += buffer;
+	else
+		write_all(buffer);
+
+	clear();
+}
+
+void ResponseWriter::take_lines(string& to)
+{
+	to.swap(lines);
+	lines.erase();
+}
+
+void ResponseWriter::write_all(const string& data)
+{
+	const char* pos = data.data();
+	size_t remaining = data.length();
+
+	while (remaining > 0)
+	{
+		int written = (int) WRITE(fd, pos, remaining);
+
+		// interrupted by a signal before anything was written
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+
+		pos += written;
+		remaining -= written;
+	}
+}
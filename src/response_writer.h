@@ -0,0 +1,66 @@
+#ifndef RESPONSE_WRITER_H
+#define RESPONSE_WRITER_H
+
+#include <string>
+#include <vector>
+#include <json/json.h>
+#include <CLucene.h>
+
+using namespace std;
+
+/**
+* Builds one line protocol response directly into a reusable buffer and
+* writes it to the output with a single write() when the response is complete.
+*
+* Commas between members and elements are inserted automatically, e.g.
+*
+*	out.begin_object().key("code").number(200L).key("json").begin_object()
+*		.key("rows").begin_array().end_array().end_object().end_object();
+*	out.flush();
+*
+* A writer created with fd -1 keeps completed lines instead of writing them,
+* for handlers running on worker threads whose output must be ordered.
+*/
+class ResponseWriter {
+private:
+	int fd;
+	string buffer;
+	string lines;   // completed lines kept when fd is -1
+	string scratch; // utf-8 conversion of wide strings
+	vector<bool> first; // one entry per open object or array, true until it has a member
+	bool after_key;
+	void separate();
+public:
+	ResponseWriter(int fd = 1);
+
+	ResponseWriter& begin_object();
+	ResponseWriter& end_object();
+	ResponseWriter& begin_array();
+	ResponseWriter& end_array();
+	ResponseWriter& key(const char* name);
+
+	ResponseWriter& string_value(const char* value, size_t length);
+	ResponseWriter& string_value(const string& value);
+	ResponseWriter& string_value(const TCHAR* value);
+	ResponseWriter& number(int value);
+	ResponseWriter& number(long value);
+	ResponseWriter& number(double value);
+	ResponseWriter& boolean(bool value);
+	ResponseWriter& value(const Json::Value& value);
+	ResponseWriter& raw(const char* json, size_t length);
+
+	// the response so far, without the trailing newline
+	const string& str() const;
+	void clear();
+
+	// terminate the line, write it in one call and reset the buffer for reuse
+	void flush();
+
+	// completed lines of a writer created with fd -1, swapped into the caller's string
+	void take_lines(string& to);
+
+	// write already formatted output to the fd in as few calls as the OS allows
+	void write_all(const string& data);
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include "stats.h"
+
+#ifdef _MSC_VER
+    #include <windows.h>
+#else
+    #include <sys/time.h>
+#endif
+
+// values below this are counted exactly, above it each power of two has this many buckets
+static const uint64_t SUB_BUCKETS = 16;
+static const size_t BUCKET_COUNT = 16 + 60 * 16;
+
+uint64_t now_micros()
+{
+#ifdef _MSC_VER
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	uint64_t t = ((uint64_t) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return t / 10; // 100ns intervals
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	count = 0;
+	sum = 0;
+	max = 0;
+}
+
+size_t LatencyHistogram::bucket_index(uint64_t value)
+{
+	if (value < SUB_BUCKETS)
+		return (size_t) value;
+
+	size_t exponent = 0;
+	for (uint64_t v = value; v > 1; v >>= 1)
+		exponent++;
+
+	size_t shift = exponent - 4;
+	return (size_t) (SUB_BUCKETS + shift * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1)));
+}
+
+uint64_t LatencyHistogram::bucket_value(size_t index)
+{
+	if (index < SUB_BUCKETS)
+		return index;
+
+	size_t shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+	uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+	uint64_t lower = (SUB_BUCKETS + sub) << shift;
+
+	// the middle of the bucket
+	return lower + (((uint64_t) 1 << shift) - 1) / 2;
+}
+
+void LatencyHistogram::record(uint64_t micros)
+{
+	if (buckets.empty())
+		buckets.assign(BUCKET_COUNT, 0);
+
+	size_t index = bucket_index(micros);
+	if (index >= BUCKET_COUNT)
+		index = BUCKET_COUNT - 1;
+
+	buckets[index]++;
+	count++;
+	sum += micros;
+	if (micros > max)
+		max = micros;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	if (count == 0)
+		return 0;
+
+	uint64_t target = (uint64_t) (p / 100.0 * (double) count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets.size(); i++)
+	{
+		seen += buckets[i];
+		if (seen >= target)
+		{
+			uint64_t value = bucket_value(i);
+			return (value < max) ? value : max;
+		}
+	}
+
+	return max;
+}
+
+void LatencyHistogram::write(ResponseWriter& out) const
+{
+	out.begin_object();
+	out.key("count").number((double) count);
+	out.key("mean_us").number((double) (count > 0 ? sum / count : 0));
+	out.key("p50_us").number((double) percentile(50));
+	out.key("p90_us").number((double) percentile(90));
+	out.key("p99_us").number((double) percentile(99));
+	out.key("p999_us").number((double) percentile(99.9));
+	out.key("max_us").number((double) max);
+	out.end_object();
+}
+
+void Stats::increment(const string& name, int64_t by)
+{
+	SCOPED_LOCK_MUTEX(lock);
+	counters[name] += by;
+}
+
+void Stats::set(const string& name, int64_t value)
+{
+	SCOPED_LOCK_MUTEX(lock);
+	gauges[name] = value;
+}
+
+void Stats::record(const string& name, uint64_t micros)
+{
+	SCOPED_LOCK_MUTEX(lock);
+	histograms[name].record(micros);
+}
+
+int64_t Stats::counter(const string& name) const
+{
+	SCOPED_LOCK_MUTEX(lock);
+
+	map<string, int64_t>::const_iterator itr = counters.find(name);
+	return (itr != counters.end()) ? itr->second : 0;
+}
+
+void Stats::write(ResponseWriter& out) const
+{
+	SCOPED_LOCK_MUTEX(lock);
+
+	out.key("counters").begin_object();
+	for (map<string, int64_t>::const_iterator itr = counters.begin(); itr != counters.end(); ++itr)
+		out.key(itr->first.c_str()).number((double) itr->second);
+	out.end_object();
+
+	out.key("gauges").begin_object();
+	for (map<string, int64_t>::const_iterator itr = gauges.begin(); itr != gauges.end(); ++itr)
+		out.key(itr->first.c_str()).number((double) itr->second);
+	out.end_object();
+
+	out.key("latency").begin_object();
+	for (map<string, LatencyHistogram>::const_iterator itr = histograms.begin(); itr != histograms.end(); ++itr)
+	{
+		out.key(itr->first.c_str());
+		itr->second.write(out);
+	}
+	out.end_object();
+}
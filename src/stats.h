@@ -0,0 +1,72 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <CLucene.h>
+
+#include "response_writer.h"
+
+using namespace std;
+
+// wall clock in microseconds, for timing short operations
+uint64_t now_micros();
+
+/**
+* Latency histogram with HDR style buckets: 16 linear sub-buckets for every
+* power of two, so any recorded value is reported within 1/16 of itself while
+* the whole range from 1us to hours fits in a few hundred counters.
+*/
+class LatencyHistogram {
+private:
+	vector<uint64_t> buckets;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	static size_t bucket_index(uint64_t value);
+	static uint64_t bucket_value(size_t index);
+public:
+	LatencyHistogram();
+
+	void record(uint64_t micros);
+	uint64_t percentile(double p) const;
+
+	// {"count": _, "mean_us": _, "p50_us": _, "p90_us": _, "p99_us": _, "p999_us": _, "max_us": _}
+	void write(ResponseWriter& out) const;
+};
+
+/**
+* Named counters, gauges and latency histograms shared by the threads of one
+* process. Names are created on first use.
+*/
+class Stats {
+private:
+	map<string, int64_t> counters;
+	map<string, int64_t> gauges;
+	map<string, LatencyHistogram> histograms;
+	mutable _LUCENE_THREADMUTEX lock;
+public:
+	void increment(const string& name, int64_t by = 1);
+	void set(const string& name, int64_t value);
+	void record(const string& name, uint64_t micros);
+
+	int64_t counter(const string& name) const;
+
+	// writes the "counters", "gauges" and "latency" members of an open object
+	void write(ResponseWriter& out) const;
+};
+
+// records the time from construction to destruction in a histogram
+class StatsTimer {
+private:
+	Stats& stats;
+	const char* name;
+	uint64_t start;
+public:
+	StatsTimer(Stats& s, const char* histogram) : stats(s), name(histogram), start(now_micros()) {}
+	~StatsTimer() { stats.record(name, now_micros() - start); }
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "utf8.h"
+
+static const unsigned long REPLACEMENT_CHAR = 0xfffd;
+
+// decode the code point starting at in[*pos] and advance pos past it
+static unsigned long decode_utf8(const unsigned char* in, size_t length, size_t* pos)
+{
+	unsigned long c = in[*pos];
+	size_t extra;
+	unsigned long min;
+
+	if (c < 0x80)
+	{
+		(*pos)++;
+		return c;
+	}
+	else if ((c & 0xe0) == 0xc0) { extra = 1; min = 0x80; c &= 0x1f; }
+	else if ((c & 0xf0) == 0xe0) { extra = 2; min = 0x800; c &= 0x0f; }
+	else if ((c & 0xf8) == 0xf0) { extra = 3; min = 0x10000; c &= 0x07; }
+	else
+	{
+		(*pos)++;
+		return REPLACEMENT_CHAR;
+	}
+
+	size_t i = *pos + 1;
+	for (size_t n = 0; n < extra; n++, i++)
+	{
+		if (i >= length || (in[i] & 0xc0) != 0x80)
+		{
+			// truncated sequence, resume at the offending byte
+			*pos = i;
+			return REPLACEMENT_CHAR;
+		}
+		c = (c << 6) | (in[i] & 0x3f);
+	}
+
+	*pos = i;
+
+	// reject overlong encodings, surrogates and values beyond unicode
+	if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+		return REPLACEMENT_CHAR;
+
+	return c;
+}
+
+static void append_code_point(unsigned long c, wstring& out)
+{
+	if (c > 0xffff && sizeof(TCHAR) == 2)
+	{
+		// 16 bit wchar_t holds utf-16, split into a surrogate pair
+		c -= 0x10000;
+		out += (TCHAR) (0xd800 + (c >> 10));
+		out += (TCHAR) (0xdc00 + (c & 0x3ff));
+	}
+	else
+		out += (TCHAR) c;
+}
+
+void utf8_to_tchar(const char* in, size_t length, wstring& out)
+{
+	const unsigned char* bytes = (const unsigned char*) in;
+	size_t pos = 0;
+
+	out.erase();
+
+	while (pos < length)
+	{
+		// runs of ascii are the common case in both ids and field values
+		if (bytes[pos] < 0x80)
+			out += (TCHAR) bytes[pos++];
+		else
+			append_code_point(decode_utf8(bytes, length, &pos), out);
+	}
+}
+
+void utf8_to_tchar(const string& in, wstring& out)
+{
+	utf8_to_tchar(in.data(), in.length(), out);
+}
+
+void utf16_to_tchar(const unsigned short* in, size_t length, wstring& out)
+{
+	out.erase();
+
+	if (sizeof(TCHAR) == 2)
+	{
+		out.append((const TCHAR*) in, length);
+		return;
+	}
+
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned long c = in[i];
+
+		if (c >= 0xd800 && c <= 0xdbff && i + 1 < length && in[i + 1] >= 0xdc00 && in[i + 1] <= 0xdfff)
+		{
+			c = 0x10000 + ((c - 0xd800) << 10) + (in[i + 1] - 0xdc00);
+			i++;
+		}
+		else if (c >= 0xd800 && c <= 0xdfff)
+			c = REPLACEMENT_CHAR; // unpaired surrogate
+
+		out += (TCHAR) c;
+	}
+}
+
+void utf8_to_utf16(const char* in, size_t length, vector<unsigned short>& out)
+{
+	const unsigned char* bytes = (const unsigned char*) in;
+	size_t pos = 0;
+
+	out.clear();
+
+	while (pos < length)
+	{
+		unsigned long c = (bytes[pos] < 0x80) ? bytes[pos++] : decode_utf8(bytes, length, &pos);
+
+		if (c > 0xffff)
+		{
+			c -= 0x10000;
+			out.push_back((unsigned short) (0xd800 + (c >> 10)));
+			out.push_back((unsigned short) (0xdc00 + (c & 0x3ff)));
+		}
+		else
+			out.push_back((unsigned short) c);
+	}
+}
+
+void tchar_to_utf8(const TCHAR* in, string& out)
+{
+	out.erase();
+	append_utf8(in, out);
+}
+
+void append_utf8(const TCHAR* in, string& out)
+{
+	for (const TCHAR* p = in; *p != 0; p++)
+	{
+		unsigned long c = (unsigned long) *p;
+
+		// 16 bit wchar_t holds utf-16, combine surrogate pairs
+		if (c >= 0xd800 && c <= 0xdbff && p[1] >= 0xdc00 && p[1] <= 0xdfff)
+		{
+			c = 0x10000 + ((c - 0xd800) << 10) + ((unsigned long) p[1] - 0xdc00);
+			p++;
+		}
+		else if (c >= 0xd800 && c <= 0xdfff)
+			c = REPLACEMENT_CHAR;
+
+		if (c < 0x80)
+			out += (char) c;
+		else if (c < 0x800)
+		{
+			out += (char) (0xc0 | (c >> 6));
+			out += (char) (0x80 | (c & 0x3f));
+		}
+		else if (c < 0x10000)
+		{
+			out += (char) (0xe0 | (c >> 12));
+			out += (char) (0x80 | ((c >> 6) & 0x3f));
+			out += (char) (0x80 | (c & 0x3f));
+		}
+		else
+		{
+			out += (char) (0xf0 | (c >> 18));
+			out += (char) (0x80 | ((c >> 12) & 0x3f));
+			out += (char) (0x80 | ((c >> 6) & 0x3f));
+			out += (char) (0x80 | (c & 0x3f));
+		}
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <string>
+#include <vector>
+#include <CLucene.h>
+
+using namespace std;
+
+/**
+* UTF-8 <-> TCHAR conversion for strings passing between CouchDB (utf-8 JSON),
+* SpiderMonkey (utf-16) and CLucene (TCHAR, utf-32 or utf-16 depending on the
+* platform's wchar_t).
+*
+* The output string is overwritten, not reallocated, so callers keep one
+* buffer per conversion outside their loops and reuse its capacity.
+* Invalid utf-8 sequences decode to U+FFFD.
+*/
+void utf8_to_tchar(const char* in, size_t length, wstring& out);
+void utf8_to_tchar(const string& in, wstring& out);
+
+void utf16_to_tchar(const unsigned short* in, size_t length, wstring& out);
+void utf8_to_utf16(const char* in, size_t length, vector<unsigned short>& out);
+
+void tchar_to_utf8(const TCHAR* in, string& out);
+
+// appends rather than overwrites, for building larger documents
+void append_utf8(const TCHAR* in, string& out);
+
+#endif